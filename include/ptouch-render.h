@@ -0,0 +1,166 @@
+/*
+	ptouch-render - render, compose and rasterize labels for ptouch-print
+
+	Copyright (C) 2015-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef PTOUCH_RENDER_H
+#define PTOUCH_RENDER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <gd.h>
+
+#include "ptouch.h"
+
+#define MAX_LINES 8	/* maybe this should depend on tape size */
+#define RASTER_TILE 64	/* number of columns rasterized in one go */
+#define METRICS_CACHE_SIZE 256	/* number of cached text bounding boxes */
+#define GLYPH_CHARS 128	/* characters which can be pre-rendered (ASCII) */
+#define GLYPH_UNIT 1000	/* glyph advances are in 1/GLYPH_UNIT pixels */
+#define GLYPH_PENS 64	/* pen positions tried to measure the glyphs */
+
+typedef enum { STATS_OFF, STATS_TEXT, STATS_JSON } stats_type_t;
+typedef enum { BATCH_CSV, BATCH_TSV, BATCH_JOBS } batch_format_t;
+typedef enum { ALIGN_LEFT = 'l', ALIGN_CENTER = 'c', ALIGN_RIGHT = 'r' } align_type_t;
+
+struct arguments {
+	align_type_t align;
+	bool chain;
+	bool precut;
+	int copies;
+	bool debug;
+	bool info;
+	bool invert;
+	char *font_file;
+	int font_size;
+	int max_length;
+	int forced_tape_width;
+	char *save_png;
+	char *write_raw;
+	char *send_raw;
+	char *daemon_socket;
+	char *printer;
+	char *virtual_printer;
+	bool all_printers;
+	stats_type_t stats;
+	char *batch_file;
+	batch_format_t batch_format;
+	int render_threads;
+	char *sequence;
+	char *cache_dir;
+	int verbose;
+	int timeout;
+	int wait;	/* seconds to wait for a printer, 0 forever, -1 not at all */
+};
+typedef enum { JOB_CUTMARK, JOB_IMAGE, JOB_PAD, JOB_TEXT, JOB_UNDEFINED } job_type_t;
+
+typedef struct job {
+	job_type_t type;
+	int n;
+	char *lines[MAX_LINES];
+	struct job *next;
+} job_t;
+
+/* a character pre-rendered for render_glyphs() */
+typedef struct glyph {
+	ptouch_bitmap bm;	/* the pixels, NULL if the character is not cached */
+	int left, top;		/* position of bm from the pen on the baseline */
+	int box[4];		/* bounding box from gd: left, top, right, bottom */
+	int advance;		/* pen movement to the next character, in 1/GLYPH_UNIT pixels */
+	int pens;		/* number of pen fractions the right end is known at */
+	int pen[GLYPH_PENS];	/* those fractions, in 1/GLYPH_UNIT pixels */
+	int right[GLYPH_PENS];	/* right end of the box at each, in pixels from the pen */
+} glyph_t;
+
+typedef struct glyph_cache {
+	char *font;		/* font of all glyphs */
+	int fsz;		/* font size of all glyphs */
+	int o_bottom;		/* bottom of 'o', where the baseline is */
+	glyph_t glyph[GLYPH_CHARS];
+	int kern[GLYPH_CHARS][GLYPH_CHARS];	/* added to the advance between two characters */
+} glyph_cache_t;
+
+/* a part of a label template, see ptouch-template.c */
+typedef struct template_part {
+	int njobs;		/* number of jobs in this part */
+	bool variable;		/* a text job with fields, rendered for every label */
+	ptouch_bitmap bm;	/* the composed static part, NULL if it is empty */
+	uint8_t *raster;	/* bm encoded for the printer */
+	size_t raster_len;
+	struct _ptouch_stats stats;	/* rasterlines in raster, counted whenever it is sent */
+	glyph_cache_t *glyphs;	/* the text is drawn from these, if not NULL */
+} template_part_t;
+
+typedef struct label_template {
+	template_part_t *parts;
+	int nparts;
+	int width;		/* width of every label in pixels */
+	int offset;		/* offset of the labels on the print head */
+	bool invert;
+	bool encoded;		/* the static parts are encoded */
+} label_template_t;
+
+/* wall time in seconds spent in the phases of printing, for --stats */
+struct phase_times {
+	double open;		/* opening (and enumerating) printers */
+	double init;		/* ptouch_init() */
+	double status;		/* waiting for the printer status */
+	double render;		/* text rendering and font fitting */
+	double compose;		/* composing the label, without text rendering */
+	double raster;		/* rasterizing and encoding, without USB waits */
+};
+
+/* options of the program, the rendering functions use them as well */
+extern struct arguments arguments;
+extern struct phase_times phase_times;
+
+double phase_clock(void);
+void phase_add(double *phase, double seconds);
+
+ptouch_bitmap image_load(const char *file);
+char *label_cache_device(ptouch_dev ptdev, int print_width);
+char *label_cache_key(const char *device, job_t *job_list, const label_template_t *tmpl, bool chain, bool precut);
+int label_cache_get(const char *dir, const char *key, uint8_t **data, size_t *len, int *columns);
+int label_cache_put(const char *dir, const char *key, const uint8_t *data, size_t len, int columns);
+void rasterize_tile(gdImage *im, int dark, int offset, int x0, int ncols, uint8_t *lines, size_t bpl);
+char *text_bbox(char *font, int fsz, char *text, int brect[8]);
+void text_cache_free(void);
+int get_baselineoffset(char *text, char *font, int fsz);
+int find_fontsize(int want_px, int max_len, char *font, char *text);
+int fit_fontsize(char *font, char *line[], int lines, int print_width);
+int needed_width(char *text, char *font, int fsz);
+ptouch_bitmap image_to_bitmap(gdImage *im);
+gdImage *bitmap_to_image(ptouch_bitmap bm);
+int print_begin(ptouch_dev ptdev, int length, int width, int chain, int precut);
+int print_columns(ptouch_dev ptdev, ptouch_bitmap bm, int x, int n, int offset, int invert);
+int print_end(ptouch_dev ptdev);
+int print_img(ptouch_dev ptdev, ptouch_bitmap bm, int chain, int precut, int invert);
+long template_field(const char *p, const char **end);
+bool template_job_is_variable(job_t *job);
+label_template_t *template_compile(job_t *job_list, int print_width, ptouch_dev ptdev);
+void template_free(label_template_t *t);
+int template_compose(label_template_t *t, job_t *job_list, int print_width, bool fill_static, ptouch_bitmap *out, int **part_len);
+int template_glyphs(label_template_t *t, job_t **samples, int nsamples, const char *chars, int print_width);
+int print_template(ptouch_dev ptdev, label_template_t *t, ptouch_bitmap bm, const int *part_len, int chain, int precut);
+int write_png(ptouch_bitmap bm, const char *file);
+int compose_label(job_t *job_list, int print_width, ptouch_bitmap *out);
+gdImage *render_text(char *font, char *line[], int lines, int print_width);
+glyph_cache_t *glyph_cache_new(char *font, int fsz, const char *chars);
+void glyph_cache_free(glyph_cache_t *gc);
+int render_glyphs(glyph_cache_t *gc, char *line[], int lines, int print_width, ptouch_bitmap *out);
+
+#endif /* PTOUCH_RENDER_H */
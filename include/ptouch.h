@@ -17,7 +17,11 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#ifndef PTOUCH_H
+#define PTOUCH_H
+
 #include <stdint.h>
+#include <stdio.h>	/* FILE */
 #ifdef __FreeBSD__
 #include <libusb.h>
 #else
@@ -88,17 +92,114 @@ struct __attribute__((packed, aligned(4))) _ptouch_stat {
 };
 typedef struct _ptouch_stat *pt_dev_stat;
 
+/* status_type values (table 5) */
+#define PT_STATUS_REPLY		0x00
+#define PT_STATUS_PRINTED	0x01
+#define PT_STATUS_ERROR		0x02
+#define PT_STATUS_TURNED_OFF	0x04
+#define PT_STATUS_NOTIFICATION	0x05
+#define PT_STATUS_PHASE_CHANGE	0x06
+
+/* Timeout of a single status read in ms, ptouch_getstatus() retries
+   until its own timeout is reached */
+#define PTOUCH_STATUS_READ_TIMEOUT	100
+
+/* Size of the bulk out buffer. Commands and rasterlines are collected
+   there and sent in as few USB transfers as possible. */
+#define PTOUCH_TXBUF_SIZE	16384
+/* Default time in ms a bulk out transfer may take before the printer is
+   taken to be jammed, see tx_timeout */
+#define PTOUCH_TX_TIMEOUT	30000
+/* Default number of bulk out transfers kept in flight in async mode */
+#define PTOUCH_ASYNC_XFERS	4
+
+struct _ptouch_async;
+struct _ptouch_watch;
+struct _ptouch_dev;
+
+/* All I/O of a printer handle goes through its transport. read() and
+   write() return 0 or a LIBUSB_ERROR_* code, a read that times out
+   returns LIBUSB_ERROR_TIMEOUT with *rx set to the bytes received. */
+struct _ptouch_transport {
+	const char *name;
+	int (*write)(struct _ptouch_dev *ptdev, uint8_t *data, size_t len, int *tx);
+	int (*read)(struct _ptouch_dev *ptdev, uint8_t *buf, size_t len, int *rx, unsigned int timeout);
+	void (*close)(struct _ptouch_dev *ptdev);
+};
+
+/* A supported printer found on the USB bus */
+struct _ptouch_found {
+	const char *name;	/* printer model */
+	int flags;		/* FLAG_* of the model */
+	uint8_t bus;		/* USB bus number */
+	uint8_t address;	/* USB device address */
+	char port[32];		/* bus and port path, e.g. "1-2.4" */
+	char serial[64];	/* serial number, empty if it can't be read */
+};
+
+/* Transfer statistics of a printer handle, updated by the library */
+struct _ptouch_stats {
+	unsigned long transfers;	/* bulk out transfers */
+	size_t bytes_out;	/* bytes sent to the printer */
+	size_t raster_lines;	/* rasterlines passed to ptouch_sendraster() */
+	size_t raster_raw;	/* rasterline bytes before encoding */
+	size_t raster_encoded;	/* rasterline bytes after encoding, with headers */
+	double tx_seconds;	/* time spent waiting for bulk out transfers */
+};
+
 struct _ptouch_dev {
-	libusb_device_handle *h;
+	const struct _ptouch_transport *tr;
+	void *tr_data;		/* private data of the transport */
+	libusb_device_handle *h;	/* NULL if the transport is not USB */
 	pt_dev_info devinfo;
 	pt_dev_stat status;
 	uint16_t tape_width_px;
+	uint8_t *txbuf;		/* pending bulk out data */
+	size_t txlen;		/* bytes used in txbuf */
+	size_t txsize;		/* allocated size of txbuf */
+	struct _ptouch_async *async;	/* transfer ring, NULL in sync mode */
+	uint8_t *recbuf;	/* recorded data, NULL if not recording */
+	size_t reclen;
+	size_t recsize;
+	struct _ptouch_watch *watch;	/* status watch, NULL if inactive */
+	FILE *raw_out;		/* data goes here instead of the printer, see ptouch_redirect() */
+	struct _ptouch_stats stats;
+	unsigned int tx_timeout;	/* ms a bulk out transfer may take, 0 for no limit */
 };
 typedef struct _ptouch_dev *ptouch_dev;
 
+/* A label with one bit per pixel, stored column by column the way the
+   printer takes its rasterlines. Pixel row y (0 is the top) of column x
+   is bit (width-1-y), counting from the lowest bit of the last byte of
+   the column. */
+struct _ptouch_bitmap {
+	int length;		/* number of columns */
+	int width;		/* pixels per column */
+	size_t bpl;		/* bytes per column */
+	int size;		/* number of columns allocated */
+	uint8_t *data;
+};
+typedef struct _ptouch_bitmap *ptouch_bitmap;
+
 int ptouch_open(ptouch_dev *ptdev);
+int ptouch_open_selected(ptouch_dev *ptdev, const char *selector);
+int ptouch_enumerate(struct _ptouch_found **found);
+int ptouch_open_virtual(ptouch_dev *ptdev, const char *spec);
+int ptouch_open_wait(ptouch_dev *ptdev, const char *selector, int timeout);
+int ptouch_hotplug_wait(int timeout);
+int ptouch_attached(ptouch_dev ptdev);
+void ptouch_exit(void);
 int ptouch_close(ptouch_dev ptdev);
+void ptouch_free(ptouch_dev ptdev);
 int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len);
+int ptouch_flush(ptouch_dev ptdev);
+int ptouch_async_begin(ptouch_dev ptdev, int ntransfers);
+int ptouch_async_submit(ptouch_dev ptdev);
+int ptouch_async_drain(ptouch_dev ptdev);
+int ptouch_async_end(ptouch_dev ptdev);
+int ptouch_record_begin(ptouch_dev ptdev);
+int ptouch_record_end(ptouch_dev ptdev, uint8_t **data, size_t *len);
+int ptouch_redirect(ptouch_dev ptdev, const char *file);
 int ptouch_init(ptouch_dev ptdev);
 int ptouch_lf(ptouch_dev ptdev);
 int ptouch_ff(ptouch_dev ptdev);
@@ -107,6 +208,9 @@ size_t ptouch_get_tape_width(ptouch_dev ptdev);
 int ptouch_page_flags(ptouch_dev ptdev, uint8_t page_flags);
 int ptouch_finalize(ptouch_dev ptdev, int chain);
 int ptouch_getstatus(ptouch_dev ptdev, int timeout);
+int ptouch_watch_begin(ptouch_dev ptdev);
+int ptouch_watch_poll(ptouch_dev ptdev);
+int ptouch_watch_end(ptouch_dev ptdev);
 int ptouch_getmaxwidth(ptouch_dev ptdev);
 int ptouch_send_d460bt_magic(ptouch_dev ptdev);
 int ptouch_send_d460bt_chain(ptouch_dev ptdev);
@@ -114,10 +218,28 @@ int ptouch_enable_packbits(ptouch_dev ptdev);
 int ptouch_info_cmd(ptouch_dev ptdev, int size_x);
 int ptouch_send_precut_cmd(ptouch_dev ptdev, int precut);
 int ptouch_rasterstart(ptouch_dev ptdev);
+size_t ptouch_packbits(uint8_t *dst, const uint8_t *src, size_t len);
 int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len);
 void ptouch_rawstatus(uint8_t raw[32]);
 void ptouch_list_supported();
 
+ptouch_bitmap ptouch_bitmap_new(int length, int width);
+void ptouch_bitmap_free(ptouch_bitmap bm);
+uint8_t *ptouch_bitmap_column(ptouch_bitmap bm, int x);
+int ptouch_bitmap_get(ptouch_bitmap bm, int x, int y);
+void ptouch_bitmap_set(ptouch_bitmap bm, int x, int y, int on);
+void ptouch_bitmap_set_row(ptouch_bitmap bm, int y, const uint8_t *row, int n, int flip);
+int ptouch_bitmap_pad(ptouch_bitmap bm, int n);
+int ptouch_bitmap_blit(ptouch_bitmap dst, int x, ptouch_bitmap src);
+void ptouch_bitmap_draw(ptouch_bitmap dst, int x, int y, ptouch_bitmap src);
+int ptouch_bitmap_append(ptouch_bitmap dst, ptouch_bitmap src);
+void ptouch_bitmap_cutmark(ptouch_bitmap bm, int x, int height);
+void ptouch_bitmap_invert(ptouch_bitmap bm);
+int ptouch_bitmap_line(ptouch_bitmap bm, int x, uint8_t *line, size_t bpl, int offset);
+void ptouch_bitmap_window(uint8_t *line, size_t bpl, int offset, int width);
+
 const char* pt_mediatype(unsigned char media_type);
 const char* pt_tapecolor(unsigned char tape_color);
 const char* pt_textcolor(unsigned char text_color);
+
+#endif /* PTOUCH_H */
@@ -17,7 +17,7 @@
 	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
-#define _POSIX_C_SOURCE	199309L	/* needed for nanosleep() when using -std=c11 */
+#define _POSIX_C_SOURCE	200809L	/* needed for nanosleep() and strdup() when using -std=c11 */
 
 #include <stdio.h>
 #include <stdlib.h>	/* malloc() */
@@ -26,6 +26,8 @@
 #include <sys/stat.h>	/* open() */
 #include <fcntl.h>	/* open() */
 #include <time.h>	/* nanosleep(), struct timespec */
+#include <strings.h>	/* strcasecmp() */
+#include <pthread.h>
 #include <libintl.h>	/* gettext() */
 
 #include "ptouch.h"
@@ -94,113 +96,1177 @@ struct _pt_dev_info ptdevs[] = {
 	{0,0,"",0,0,0}
 };
 
+/* return the index in ptdevs[] of a supported printer, or -1 */
+static int ptouch_find_model(struct libusb_device_descriptor *desc)
+{
+	for (int k=0; ptdevs[k].vid > 0; ++k) {
+		if ((desc->idVendor == ptdevs[k].vid) && (desc->idProduct == ptdevs[k].pid) && (ptdevs[k].flags >= 0)) {
+			return k;
+		}
+	}
+	return -1;
+}
+
+/* bus and port path of dev like in sysfs, e.g. "1-2.4" */
+static void ptouch_port_path(libusb_device *dev, char *buf, size_t size)
+{
+	uint8_t ports[8];
+	int n, len;
+
+	len=snprintf(buf, size, "%d", libusb_get_bus_number(dev));
+	n=libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (int i=0; (i < n) && (len > 0) && ((size_t)len < size); ++i) {
+		len += snprintf(buf + len, size - len, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+	}
+}
+
+/* read the serial number of dev, buf is empty if that is not possible */
+static void ptouch_serial(libusb_device *dev, struct libusb_device_descriptor *desc, char *buf, size_t size)
+{
+	libusb_device_handle *handle;
+
+	buf[0]='\0';
+	if ((desc->iSerialNumber == 0) || (libusb_open(dev, &handle) != 0)) {
+		return;
+	}
+	if (libusb_get_string_descriptor_ascii(handle, desc->iSerialNumber, (unsigned char *)buf, (int)size) < 0) {
+		buf[0]='\0';
+	}
+	libusb_close(handle);
+}
+
+/* check if dev is the printer described by selector, which is either
+   "<bus>:<address>", "<bus>-<port path>" or a serial number */
+static int ptouch_match(libusb_device *dev, struct libusb_device_descriptor *desc, const char *selector)
+{
+	char buf[64];
+
+	if (!selector || (selector[0] == '\0')) {
+		return 1;
+	}
+	snprintf(buf, sizeof(buf), "%d:%d", libusb_get_bus_number(dev), libusb_get_device_address(dev));
+	if (!strcmp(buf, selector)) {
+		return 1;
+	}
+	ptouch_port_path(dev, buf, sizeof(buf));
+	if (!strcmp(buf, selector)) {
+		return 1;
+	}
+	ptouch_serial(dev, desc, buf, sizeof(buf));
+	if ((buf[0] != '\0') && !strcmp(buf, selector)) {
+		return 1;
+	}
+	return 0;
+}
+
+/* allocate a printer handle, the transport is set up by the caller.
+   On failure nothing is left allocated and *ptdev is NULL. */
+static int ptouch_alloc(ptouch_dev *ptdev)
+{
+	if ((*ptdev=calloc(1, sizeof(struct _ptouch_dev))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return -1;
+	}
+	(*ptdev)->devinfo=malloc(sizeof(struct _pt_dev_info));
+	(*ptdev)->status=calloc(1, sizeof(struct _ptouch_stat));
+	(*ptdev)->txbuf=malloc(PTOUCH_TXBUF_SIZE);
+	if (!(*ptdev)->devinfo || !(*ptdev)->status || !(*ptdev)->txbuf) {
+		fprintf(stderr, _("out of memory\n"));
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	(*ptdev)->txsize=PTOUCH_TXBUF_SIZE;
+	(*ptdev)->tx_timeout=PTOUCH_TX_TIMEOUT;
+	return 0;
+}
+
+static void ptouch_set_model(ptouch_dev ptdev, int k)
+{
+	ptdev->devinfo->vid=ptdevs[k].vid;
+	ptdev->devinfo->pid=ptdevs[k].pid;
+	ptdev->devinfo->name=ptdevs[k].name;
+	ptdev->devinfo->dpi=ptdevs[k].dpi;
+	ptdev->devinfo->max_px=ptdevs[k].max_px;
+	ptdev->devinfo->flags=ptdevs[k].flags;
+}
+
+/* --------------------------------------------------------------------
+   USB transport
+   -------------------------------------------------------------------- */
+
+static int usb_write(ptouch_dev ptdev, uint8_t *data, size_t len, int *tx)
+{
+	return libusb_bulk_transfer(ptdev->h, 0x02, data, (int)len, tx, ptdev->tx_timeout);
+}
+
+static int usb_read(ptouch_dev ptdev, uint8_t *buf, size_t len, int *rx, unsigned int timeout)
+{
+	return libusb_bulk_transfer(ptdev->h, 0x81, buf, (int)len, rx, timeout);
+}
+
+static void usb_close(ptouch_dev ptdev)
+{
+	libusb_release_interface(ptdev->h, 0);
+	libusb_close(ptdev->h);
+	ptdev->h=NULL;
+}
+
+static const struct _ptouch_transport usb_transport = {
+	"usb", usb_write, usb_read, usb_close
+};
+
+/* --------------------------------------------------------------------
+   Virtual printer: records everything sent to it in a file (or pipe)
+   and answers status requests with a configurable status reply, so
+   the whole print path can be run and checked without hardware.
+   -------------------------------------------------------------------- */
+
+struct _ptouch_virtual {
+	FILE *out;
+	uint8_t status[32];
+	int replies;		/* number of status requests not answered yet */
+	uint8_t cmd[3];		/* start of the command being received */
+	int cmd_len;		/* bytes in cmd */
+	size_t skip;		/* rest of the command to skip, e.g. raster data */
+};
+
+/* length of the command starting with the n bytes in cmd, 0 if that
+   can't be told yet */
+static size_t virtual_cmd_len(const uint8_t *cmd, int n)
+{
+	switch (cmd[0]) {
+		case 0x1b:	/* ESC */
+			if (n < 2) {
+				return 0;
+			}
+			if (cmd[1] != 'i') {
+				return 2;	/* ESC @ */
+			}
+			if (n < 3) {
+				return 0;
+			}
+			switch (cmd[2]) {
+				case 'z':
+					return 13;
+				case 'd':
+					return 7;
+				case 'a':
+				case 'R':
+				case 'M':
+				case 'K':
+					return 4;
+				default:
+					return 3;	/* ESC i S */
+			}
+		case 'M':	/* compression mode */
+			return 2;
+		case 'G':	/* rasterline with a 16 bit length */
+		case 'g':	/* rasterline with an 8 bit length */
+			if (n < 3) {
+				return 0;
+			}
+			return 3 + ((cmd[0] == 'G') ? (cmd[1] | (cmd[2] << 8)) : cmd[2]);
+		default:	/* invalidate, Z, FF, print command */
+			return 1;
+	}
+}
+
+/* Follow the command boundaries, so ESC i S is only taken as a status
+   request where a command starts and not within other data */
+static int virtual_write(ptouch_dev ptdev, uint8_t *data, size_t len, int *tx)
+{
+	struct _ptouch_virtual *v = ptdev->tr_data;
+
+	*tx=0;
+	if (v->out && (fwrite(data, 1, len, v->out) != len)) {
+		return LIBUSB_ERROR_IO;
+	}
+	for (size_t i=0; i<len; ++i) {
+		if (v->skip > 0) {
+			size_t n = (len - i < v->skip) ? len - i : v->skip;
+			v->skip -= n;
+			i += n - 1;
+			continue;
+		}
+		v->cmd[v->cmd_len++]=data[i];
+		size_t cmd_len = virtual_cmd_len(v->cmd, v->cmd_len);
+		if ((cmd_len == 0) && (v->cmd_len < (int)sizeof(v->cmd))) {
+			continue;
+		}
+		if ((v->cmd_len == 3) && !memcmp(v->cmd, "\x1biS", 3)) {
+			v->replies++;
+		}
+		v->skip=(cmd_len > (size_t)v->cmd_len) ? cmd_len - v->cmd_len : 0;
+		v->cmd_len=0;
+	}
+	*tx=(int)len;
+	return 0;
+}
+
+static int virtual_read(ptouch_dev ptdev, uint8_t *buf, size_t len, int *rx, unsigned int timeout)
+{
+	struct _ptouch_virtual *v = ptdev->tr_data;
+
+	(void)timeout;
+	*rx=0;
+	if (v->replies == 0) {
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	v->replies--;
+	*rx=(len < 32) ? (int)len : 32;
+	memcpy(buf, v->status, *rx);
+	return 0;
+}
+
+static void virtual_close(ptouch_dev ptdev)
+{
+	struct _ptouch_virtual *v = ptdev->tr_data;
+
+	if (v->out && (v->out != stdout)) {
+		fclose(v->out);
+	} else if (v->out) {
+		fflush(v->out);
+	}
+	free(v);
+	ptdev->tr_data=NULL;
+}
+
+static const struct _ptouch_transport virtual_transport = {
+	"virtual", virtual_write, virtual_read, virtual_close
+};
+
+/* --------------------------------------------------------------------
+	Open a virtual printer. spec is a comma separated list of
+	  out=<file>	where to record the data stream ("-" for stdout)
+	  model=<name>	printer model as in ptdevs[] (default PT-P700)
+	  tape=<mm>	tape width (default 24)
+	  media=<n>	media type, table 4 (default 0x01, laminated)
+	  color=<n>	tape color, table 8 (default 0x01, white)
+	  text=<n>	text color, table 9 (default 0x08, black)
+	  error=<n>	error bits, table 1 and 2 (default 0)
+	  status=<hex>	complete 32 byte status reply as 64 hex digits
+   -------------------------------------------------------------------- */
+int ptouch_open_virtual(ptouch_dev *ptdev, const char *spec)
+{
+	struct _ptouch_virtual *v;
+	char *buf, *opt, *save = NULL;
+	int k=-1, rc=0;
+
+	for (int i=0; ptdevs[i].vid > 0; ++i) {
+		if (!strcmp(ptdevs[i].name, "PT-P700")) {
+			k=i;
+		}
+	}
+	if (ptouch_alloc(ptdev) != 0) {
+		return -1;
+	}
+	if ((v=calloc(1, sizeof(struct _ptouch_virtual))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	/* status reply of an idle printer */
+	memcpy(v->status, "\x80\x20\x42\x30\x00\x30", 6);
+	v->status[10]=24;
+	v->status[11]=0x01;
+	v->status[24]=0x01;
+	v->status[25]=0x08;
+	if ((buf=strdup(spec ? spec : "")) == NULL) {
+		free(v);
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	for (opt=strtok_r(buf, ",", &save); opt && (rc == 0); opt=strtok_r(NULL, ",", &save)) {
+		char *val=strchr(opt, '=');
+		if (!val) {
+			rc=-1;
+			break;
+		}
+		*val++='\0';
+		unsigned long n=strtoul(val, NULL, 0);
+		if (!strcmp(opt, "out")) {
+			v->out=strcmp(val, "-") ? fopen(val, "wb") : stdout;
+			if (!v->out) {
+				fprintf(stderr, _("could not open '%s'\n"), val);
+				rc=-1;
+			}
+		} else if (!strcmp(opt, "model")) {
+			k=-1;
+			for (int i=0; ptdevs[i].vid > 0; ++i) {
+				if (!strcasecmp(ptdevs[i].name, val)) {
+					k=i;
+				}
+			}
+			if (k < 0) {
+				fprintf(stderr, _("unknown printer model '%s'\n"), val);
+				rc=-1;
+			}
+		} else if (!strcmp(opt, "tape")) {
+			v->status[10]=(uint8_t)n;
+		} else if (!strcmp(opt, "media")) {
+			v->status[11]=(uint8_t)n;
+		} else if (!strcmp(opt, "color")) {
+			v->status[24]=(uint8_t)n;
+		} else if (!strcmp(opt, "text")) {
+			v->status[25]=(uint8_t)n;
+		} else if (!strcmp(opt, "error")) {
+			v->status[8]=(uint8_t)(n & 0xff);
+			v->status[9]=(uint8_t)((n >> 8) & 0xff);
+		} else if (!strcmp(opt, "status") && (strlen(val) == 64)) {
+			for (int i=0; i<32; ++i) {
+				char hex[3] = { val[2*i], val[2*i+1], '\0' };
+				v->status[i]=(uint8_t)strtoul(hex, NULL, 16);
+			}
+		} else {
+			rc=-1;
+		}
+	}
+	free(buf);
+	if ((rc != 0) || (k < 0)) {
+		fprintf(stderr, _("invalid virtual printer specification '%s'\n"), spec);
+		if (v->out && (v->out != stdout)) {
+			fclose(v->out);
+		}
+		free(v);
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	(*ptdev)->tr=&virtual_transport;
+	(*ptdev)->tr_data=v;
+	ptouch_set_model(*ptdev, k);
+	return 0;
+}
+
+static long ptouch_now_ms(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (long)t.tv_sec*1000 + t.tv_nsec/1000000;
+}
+
+/* --------------------------------------------------------------------
+   Device manager: with hotplug support, libusb reports the supported
+   printers as they are plugged in, switched on or woken up, and as they
+   go away. They are kept in a table, so opening a printer does not
+   enumerate the whole bus, and a caller waiting for a printer can go on
+   as soon as one arrives. Without hotplug support the bus is enumerated
+   as before.
+   -------------------------------------------------------------------- */
+
+#define PTOUCH_MAX_ATTACHED	32	/* printers kept in the table */
+#define PTOUCH_MAX_VIDS	4	/* different vendor ids in ptdevs[] */
+
+static struct {
+	int state;		/* 0 libusb not set up, 1 hotplug, -1 enumeration only */
+	libusb_hotplug_callback_handle cb[PTOUCH_MAX_VIDS];
+	int ncb;
+	pthread_mutex_t lock;	/* the callback runs in whichever thread handles events */
+	libusb_device *dev[PTOUCH_MAX_ATTACHED];	/* attached printers, referenced */
+	int n;
+	unsigned long arrivals;	/* counts the printers that arrived */
+} hotplug = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int LIBUSB_CALL ptouch_hotplug_cb(libusb_context *ctx, libusb_device *dev, libusb_hotplug_event event, void *user_data)
+{
+	struct libusb_device_descriptor desc;
+	int i;
+
+	(void)ctx;
+	(void)user_data;
+	/* the callbacks are filtered by vendor only */
+	if ((libusb_get_device_descriptor(dev, &desc) != 0) || (ptouch_find_model(&desc) < 0)) {
+		return 0;
+	}
+	pthread_mutex_lock(&hotplug.lock);
+	for (i=0; (i < hotplug.n) && (hotplug.dev[i] != dev); ++i) {
+	}
+	if ((event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) && (i == hotplug.n) && (i < PTOUCH_MAX_ATTACHED)) {
+		hotplug.dev[hotplug.n++]=libusb_ref_device(dev);
+		hotplug.arrivals++;
+	} else if ((event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) && (i < hotplug.n)) {
+		libusb_unref_device(hotplug.dev[i]);
+		/* keep the order of arrival */
+		memmove(&hotplug.dev[i], &hotplug.dev[i+1], (hotplug.n - i - 1) * sizeof(libusb_device *));
+		hotplug.n--;
+	}
+	pthread_mutex_unlock(&hotplug.lock);
+	return 0;
+}
+
+/* deregister the hotplug callbacks and empty the table */
+static void ptouch_exit_hotplug(void)
+{
+	for (int i=0; i<hotplug.ncb; ++i) {
+		libusb_hotplug_deregister_callback(NULL, hotplug.cb[i]);
+	}
+	hotplug.ncb=0;
+	pthread_mutex_lock(&hotplug.lock);
+	for (int i=0; i<hotplug.n; ++i) {
+		libusb_unref_device(hotplug.dev[i]);
+	}
+	hotplug.n=0;
+	pthread_mutex_unlock(&hotplug.lock);
+}
+
+/* set up libusb once, and the hotplug callbacks if they are supported.
+   The printers already attached are reported while registering. */
+static int ptouch_usb_init(void)
+{
+	if (hotplug.state != 0) {
+		return 0;
+	}
+	if ((libusb_init(NULL)) < 0) {
+		fprintf(stderr, _("libusb_init() failed\n"));
+		return -1;
+	}
+	hotplug.state=-1;
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		return 0;
+	}
+	for (int k=0; ptdevs[k].vid > 0; ++k) {
+		int i;
+		for (i=0; (i < k) && (ptdevs[i].vid != ptdevs[k].vid); ++i) {
+		}
+		if (i < k) {
+			continue;	/* vendor has a callback already */
+		}
+		if ((hotplug.ncb == PTOUCH_MAX_VIDS) || (libusb_hotplug_register_callback(NULL,
+		    LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		    LIBUSB_HOTPLUG_ENUMERATE, ptdevs[k].vid, LIBUSB_HOTPLUG_MATCH_ANY,
+		    LIBUSB_HOTPLUG_MATCH_ANY, ptouch_hotplug_cb, NULL, &hotplug.cb[hotplug.ncb]) != 0)) {
+			ptouch_exit_hotplug();
+			return 0;
+		}
+		hotplug.ncb++;
+	}
+	hotplug.state=1;
+	return 0;
+}
+
+/* take over the hotplug events which arrived since the last call */
+static void ptouch_hotplug_poll(void)
+{
+	struct timeval tv = { 0, 0 };
+
+	if (hotplug.state == 1) {
+		libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+	}
+}
+
+/* The supported printers as a NULL terminated list of referenced
+   devices like libusb_get_device_list() returns it. The list is our own
+   copy and must be freed with ptouch_free_device_list(). Returns the
+   number of devices (with hotplug support only the supported printers)
+   or -1. */
+static ssize_t ptouch_device_list(libusb_device ***devs)
+{
+	libusb_device **list=NULL;
+	int table;
+	ssize_t n;
+
+	if (ptouch_usb_init() != 0) {
+		return -1;
+	}
+	if (!(table=(hotplug.state == 1))) {
+		if ((n=libusb_get_device_list(NULL, &list)) < 0) {
+			return -1;
+		}
+	} else {
+		ptouch_hotplug_poll();
+		pthread_mutex_lock(&hotplug.lock);
+		n=hotplug.n;
+		list=hotplug.dev;
+	}
+	if ((*devs=calloc(n + 1, sizeof(libusb_device *))) != NULL) {
+		for (ssize_t i=0; i<n; ++i) {
+			(*devs)[i]=libusb_ref_device(list[i]);
+		}
+	}
+	if (table) {
+		pthread_mutex_unlock(&hotplug.lock);
+	} else {
+		libusb_free_device_list(list, 1);
+	}
+	if (*devs == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return -1;
+	}
+	return n;
+}
+
+/* free a list from ptouch_device_list() and drop its device references */
+static void ptouch_free_device_list(libusb_device **devs)
+{
+	for (size_t i=0; devs[i] != NULL; ++i) {
+		libusb_unref_device(devs[i]);
+	}
+	free(devs);
+}
+
+/* Wait until a supported printer arrives or the deadline (in ms of
+   ptouch_now_ms(), 0 for none) has passed. Without hotplug support,
+   it waits a second for the caller to look at the bus again.
+   Returns 0 if a printer (might have) arrived, -1 on timeout. */
+static int ptouch_wait_arrival(long deadline)
+{
+	unsigned long arrivals;
+	int r, arrived=0;
+
+	if (ptouch_usb_init() != 0) {
+		return -1;
+	}
+	if (hotplug.state != 1) {
+		long left=deadline ? deadline - ptouch_now_ms() : 1000;
+		struct timespec w = { 1, 0 };
+		if (left <= 0) {
+			return -1;
+		}
+		if (left < 1000) {
+			w.tv_sec=0;
+			w.tv_nsec=left*1000000;
+		}
+		nanosleep(&w, NULL);
+		return 0;
+	}
+	pthread_mutex_lock(&hotplug.lock);
+	arrivals=hotplug.arrivals;
+	pthread_mutex_unlock(&hotplug.lock);
+	while (!arrived) {
+		struct timeval tv = { 1, 0 };
+		if (deadline) {
+			long left=deadline - ptouch_now_ms();
+			if (left <= 0) {
+				return -1;
+			}
+			if (left < 1000) {
+				tv.tv_sec=0;
+				tv.tv_usec=left*1000;
+			}
+		}
+		if (((r=libusb_handle_events_timeout_completed(NULL, &tv, NULL)) != 0) && (r != LIBUSB_ERROR_INTERRUPTED)) {
+			fprintf(stderr, _("libusb event error: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+		pthread_mutex_lock(&hotplug.lock);
+		arrived=(hotplug.arrivals != arrivals);
+		pthread_mutex_unlock(&hotplug.lock);
+	}
+	return 0;
+}
+
+/* Wait until a supported printer is plugged in or switched on, at most
+   timeout seconds (0 waits forever). Returns 0 when one has arrived
+   (or might have, without hotplug support) and -1 on timeout. */
+int ptouch_hotplug_wait(int timeout)
+{
+	return ptouch_wait_arrival(timeout ? ptouch_now_ms() + (long)timeout*1000 : 0);
+}
+
+/* Check whether the printer of ptdev is still attached. Printers which
+   are not on USB, or without hotplug support, are always taken to be. */
+int ptouch_attached(ptouch_dev ptdev)
+{
+	libusb_device *dev;
+	int found=0;
+
+	if (!ptdev || (ptdev->tr != &usb_transport) || (hotplug.state != 1)) {
+		return 1;
+	}
+	ptouch_hotplug_poll();
+	dev=libusb_get_device(ptdev->h);
+	pthread_mutex_lock(&hotplug.lock);
+	for (int i=0; i<hotplug.n; ++i) {
+		if (hotplug.dev[i] == dev) {
+			found=1;
+		}
+	}
+	pthread_mutex_unlock(&hotplug.lock);
+	return found;
+}
+
+/* Stop the device manager and release libusb. All printers have to be
+   closed before. */
+void ptouch_exit(void)
+{
+	if (hotplug.state == 0) {
+		return;
+	}
+	ptouch_exit_hotplug();
+	libusb_exit(NULL);
+	hotplug.state=0;
+}
+
+/* List all supported printers on the USB bus. Returns the number of
+   printers found (the list has to be free()d) or -1 on error. */
+int ptouch_enumerate(struct _ptouch_found **found)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	struct libusb_device_descriptor desc;
+	ssize_t cnt;
+	int i=0, n=0, k;
+
+	*found=NULL;
+	if ((cnt=ptouch_device_list(&devs)) < 0) {
+		return -1;
+	}
+	if ((*found=calloc(cnt + 1, sizeof(struct _ptouch_found))) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		ptouch_free_device_list(devs);
+		return -1;
+	}
+	while ((dev=devs[i++]) != NULL) {
+		if (libusb_get_device_descriptor(dev, &desc) < 0) {
+			continue;
+		}
+		if ((k=ptouch_find_model(&desc)) < 0) {
+			continue;
+		}
+		struct _ptouch_found *f = &(*found)[n++];
+		f->name=ptdevs[k].name;
+		f->flags=ptdevs[k].flags;
+		f->bus=libusb_get_bus_number(dev);
+		f->address=libusb_get_device_address(dev);
+		ptouch_port_path(dev, f->port, sizeof(f->port));
+		ptouch_serial(dev, &desc, f->serial, sizeof(f->serial));
+	}
+	ptouch_free_device_list(devs);
+	return n;
+}
+
 int ptouch_open(ptouch_dev *ptdev)
+{
+	return ptouch_open_selected(ptdev, NULL);
+}
+
+/* Open the first supported printer matching selector on ptdev.
+   Returns 0 if it was opened, 1 if there is none and -1 on error. */
+static int ptouch_open_usb(ptouch_dev ptdev, const char *selector)
 {
 	libusb_device **devs;
 	libusb_device *dev;
 	libusb_device_handle *handle = NULL;
 	struct libusb_device_descriptor desc;
 	ssize_t cnt;
-	int r,i=0;
+	int r,i=0,k;
 
-	if ((*ptdev=malloc(sizeof(struct _ptouch_dev))) == NULL) {
-		fprintf(stderr, _("out of memory\n"));
+//	libusb_set_debug(NULL, 3);
+	if ((cnt=ptouch_device_list(&devs)) < 0) {
+		return -1;
+	}
+	while ((dev=devs[i++]) != NULL) {
+		if ((r=libusb_get_device_descriptor(dev, &desc)) < 0) {
+			fprintf(stderr, _("failed to get device descriptor"));
+			ptouch_free_device_list(devs);
+			return -1;
+		}
+		if ((k=ptouch_find_model(&desc)) < 0) {
+			continue;
+		}
+		if (!ptouch_match(dev, &desc, selector)) {
+			continue;
+		}
+		fprintf(stderr, _("%s found on USB bus %d, device %d\n"),
+			ptdevs[k].name,
+			libusb_get_bus_number(dev),
+			libusb_get_device_address(dev));
+		if (ptdevs[k].flags & FLAG_PLITE) {
+			printf("Printer is in P-Lite Mode, which is unsupported\n\n");
+			printf("Turn off P-Lite mode by changing switch from position EL to position E\n");
+			printf("or by pressing the PLite button for ~ 2 seconds (or consult the manual)\n");
+			ptouch_free_device_list(devs);
+			return -1;
+		}
+		if (ptdevs[k].flags & FLAG_UNSUP_RASTER) {
+			printf("Unfortunately, that printer currently is unsupported (it has a different raster data transfer)\n");
+			ptouch_free_device_list(devs);
+			return -1;
+		}
+		if ((r=libusb_open(dev, &handle)) != 0) {
+			fprintf(stderr, _("libusb_open error :%s\n"), libusb_error_name(r));
+			ptouch_free_device_list(devs);
+			return -1;
+		}
+		ptouch_free_device_list(devs);
+		if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
+			if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
+				fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
+			}
+		}
+		if ((r=libusb_claim_interface(handle, 0)) != 0) {
+			fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
+			libusb_close(handle);
+			return -1;
+		}
+		ptdev->tr=&usb_transport;
+		ptdev->h=handle;
+		ptouch_set_model(ptdev, k);
+		return 0;
+	}
+	ptouch_free_device_list(devs);
+	return 1;
+}
+
+static void ptouch_not_found(const char *selector)
+{
+	if (selector) {
+		fprintf(stderr, _("No P-Touch printer matching '%s' found on USB\n"), selector);
+	} else {
+		fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
+	}
+}
+
+/* Open the first supported printer matching selector (see
+   ptouch_match()), or the first one found if selector is NULL */
+int ptouch_open_selected(ptouch_dev *ptdev, const char *selector)
+{
+	int r;
+
+	if (ptouch_alloc(ptdev) != 0) {
+		return -1;
+	}
+	if ((r=ptouch_open_usb(*ptdev, selector)) == 1) {
+		ptouch_not_found(selector);
+	}
+	if (r != 0) {
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Like ptouch_open_selected(), but if no matching printer is attached,
+   wait for one to be plugged in or switched on, at most timeout seconds
+   (0 waits forever). The printer is opened as soon as it arrives. */
+int ptouch_open_wait(ptouch_dev *ptdev, const char *selector, int timeout)
+{
+	long deadline=timeout ? ptouch_now_ms() + (long)timeout*1000 : 0;
+	int r;
+
+	if (ptouch_alloc(ptdev) != 0) {
+		return -1;
+	}
+	if ((r=ptouch_open_usb(*ptdev, selector)) == 1) {
+		if (selector) {
+			fprintf(stderr, _("waiting for P-Touch printer '%s'\n"), selector);
+		} else {
+			fprintf(stderr, _("waiting for a P-Touch printer\n"));
+		}
+	}
+	while (r == 1) {
+		if (ptouch_wait_arrival(deadline) != 0) {
+			ptouch_not_found(selector);
+			break;
+		}
+		r=ptouch_open_usb(*ptdev, selector);
+	}
+	if (r != 0) {
+		ptouch_free(*ptdev);
+		*ptdev=NULL;
 		return -1;
 	}
-	if (((*ptdev)->devinfo=malloc(sizeof(struct _pt_dev_info))) == NULL) {
-		fprintf(stderr, _("out of memory\n"));
+	return 0;
+}
+
+int ptouch_close(ptouch_dev ptdev)
+{
+	if (!ptdev) {
 		return -1;
 	}
-	if (((*ptdev)->status=malloc(sizeof(struct _ptouch_stat))) == NULL) {
-		fprintf(stderr, _("out of memory\n"));
+	ptouch_watch_end(ptdev);
+	ptouch_async_end(ptdev);
+	ptouch_flush(ptdev);
+	if (!ptdev->tr) {
+		return 0;	/* closed already */
+	}
+	if (ptdev->raw_out && (ptdev->raw_out != stdout)) {
+		fclose(ptdev->raw_out);
+	} else if (ptdev->raw_out) {
+		fflush(ptdev->raw_out);
+	}
+	ptdev->raw_out=NULL;
+	ptdev->tr->close(ptdev);
+	ptdev->tr=NULL;
+	free(ptdev->txbuf);
+	ptdev->txbuf=NULL;
+	ptdev->txsize=0;
+	return 0;
+}
+
+/* close the printer if that wasn't done yet and free the handle */
+void ptouch_free(ptouch_dev ptdev)
+{
+	if (!ptdev) {
+		return;
+	}
+	if (ptdev->tr) {
+		ptouch_close(ptdev);
+	}
+	free(ptdev->txbuf);
+	free(ptdev->status);
+	free(ptdev->devinfo);
+	free(ptdev);
+}
+
+static double ptouch_seconds(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec/1e9;
+}
+
+static int ptouch_bulk_write(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	int r, tx;
+	double t0=ptouch_seconds();
+
+	if (ptdev->raw_out) {
+		tx=(int)fwrite(data, 1, len, ptdev->raw_out);
+		r=(tx == (int)len) ? 0 : LIBUSB_ERROR_IO;
+	} else {
+		r=ptdev->tr->write(ptdev, data, len, &tx);
+	}
+	ptdev->stats.tx_seconds += ptouch_seconds() - t0;
+	ptdev->stats.transfers++;
+	ptdev->stats.bytes_out += (r == 0) ? (size_t)tx : 0;
+	if (r != 0) {
+		fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
 		return -1;
 	}
-	if ((libusb_init(NULL)) < 0) {
-		fprintf(stderr, _("libusb_init() failed\n"));
+	if (tx != (int)len) {
+		fprintf(stderr, _("write error: could send only %i of %ld bytes\n"), tx, len);
 		return -1;
 	}
-//	libusb_set_debug(NULL, 3);
-	if ((cnt=libusb_get_device_list(NULL, &devs)) < 0) {
+	return 0;
+}
+
+/* Queue data for the printer. Data is collected in the transmit buffer
+   and only sent when the buffer is full or ptouch_flush() is called. */
+int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len)
+{
+	if (!ptdev) {
+		fprintf(stderr, _("debug: called ptouch_send() with NULL ptdev\n"));
 		return -1;
 	}
-	while ((dev=devs[i++]) != NULL) {
-		if ((r=libusb_get_device_descriptor(dev, &desc)) < 0) {
-			fprintf(stderr, _("failed to get device descriptor"));
-			libusb_free_device_list(devs, 1);
+	if (ptdev->recbuf) {
+		if (ptdev->reclen + len > ptdev->recsize) {
+			size_t size = ptdev->recsize;
+			uint8_t *p;
+			while (ptdev->reclen + len > size) {
+				size *= 2;
+			}
+			if ((p=realloc(ptdev->recbuf, size)) == NULL) {
+				fprintf(stderr, _("out of memory\n"));
+				return -1;
+			}
+			ptdev->recbuf=p;
+			ptdev->recsize=size;
+		}
+		memcpy(ptdev->recbuf + ptdev->reclen, data, len);
+		ptdev->reclen += len;
+		return 0;
+	}
+	if (ptdev->txlen + len > ptdev->txsize) {
+		if (ptdev->async && (len <= ptdev->txsize)) {
+			if (ptouch_async_submit(ptdev) != 0) {
+				return -1;
+			}
+		} else if (ptouch_flush(ptdev) != 0) {
 			return -1;
 		}
-		for (int k=0; ptdevs[k].vid > 0; ++k) {
-			if ((desc.idVendor == ptdevs[k].vid) && (desc.idProduct == ptdevs[k].pid) && (ptdevs[k].flags >= 0)) {
-				fprintf(stderr, _("%s found on USB bus %d, device %d\n"),
-					ptdevs[k].name,
-					libusb_get_bus_number(dev),
-					libusb_get_device_address(dev));
-				if (ptdevs[k].flags & FLAG_PLITE) {
-					printf("Printer is in P-Lite Mode, which is unsupported\n\n");
-					printf("Turn off P-Lite mode by changing switch from position EL to position E\n");
-					printf("or by pressing the PLite button for ~ 2 seconds (or consult the manual)\n");
-					return -1;
-				}
-				if (ptdevs[k].flags & FLAG_UNSUP_RASTER) {
-					printf("Unfortunately, that printer currently is unsupported (it has a different raster data transfer)\n");
-					return -1;
-				}
-				if ((r=libusb_open(dev, &handle)) != 0) {
-					fprintf(stderr, _("libusb_open error :%s\n"), libusb_error_name(r));
-					return -1;
-				}
-				libusb_free_device_list(devs, 1);
-				if ((r=libusb_kernel_driver_active(handle, 0)) == 1) {
-					if ((r=libusb_detach_kernel_driver(handle, 0)) != 0) {
-						fprintf(stderr, _("error while detaching kernel driver: %s\n"), libusb_error_name(r));
-					}
-				}
-				if ((r=libusb_claim_interface(handle, 0)) != 0) {
-					fprintf(stderr, _("interface claim error: %s\n"), libusb_error_name(r));
-					return -1;
-				}
-				(*ptdev)->h=handle;
-				(*ptdev)->devinfo->dpi=ptdevs[k].dpi;
-				(*ptdev)->devinfo->max_px=ptdevs[k].max_px;
-				(*ptdev)->devinfo->flags=ptdevs[k].flags;
-				return 0;
+	}
+	if (len > ptdev->txsize) {
+		/* straight from data, but in transfers no larger than the
+		   buffer, so the transfer timeout is for each of them and
+		   not for all the data a slow printer takes long to accept */
+		for (size_t pos=0; pos < len; pos += ptdev->txsize) {
+			size_t n=(len - pos < ptdev->txsize) ? len - pos : ptdev->txsize;
+			if (ptouch_bulk_write(ptdev, data + pos, n) != 0) {
+				return -1;
 			}
 		}
+		return 0;
 	}
-	fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
-	libusb_free_device_list(devs, 1);
-	return -1;
+	memcpy(ptdev->txbuf + ptdev->txlen, data, len);
+	ptdev->txlen += len;
+	return 0;
 }
 
-int ptouch_close(ptouch_dev ptdev)
+/* send all buffered data to the printer and wait until it is out */
+int ptouch_flush(ptouch_dev ptdev)
 {
+	int r;
+
 	if (!ptdev) {
+		fprintf(stderr, _("debug: called ptouch_flush() with NULL ptdev\n"));
 		return -1;
 	}
-	libusb_release_interface(ptdev->h, 0);
-	libusb_close(ptdev->h);
+	if (ptdev->async) {
+		return ptouch_async_drain(ptdev);
+	}
+	if (ptdev->txlen == 0) {
+		return 0;
+	}
+	r=ptouch_bulk_write(ptdev, ptdev->txbuf, ptdev->txlen);
+	ptdev->txlen=0;
+	return r;
+}
+
+/* --------------------------------------------------------------------
+   Asynchronous transmission: in async mode the transmit buffer is one
+   slot of a ring of libusb transfers. A full buffer is submitted and
+   the caller continues with the next free slot, so new rasterlines can
+   be encoded while the previous ones are still on the wire.
+   -------------------------------------------------------------------- */
+
+struct _ptouch_xfer {
+	struct libusb_transfer *t;
+	uint8_t *buf;
+	int done;		/* 0 while the transfer is in flight */
+};
+
+struct _ptouch_async {
+	int n;			/* number of transfers in the ring */
+	int cur;		/* slot which is currently being filled */
+	int error;		/* set by the callback if a transfer failed */
+	uint8_t *syncbuf;	/* txbuf of sync mode, restored at the end */
+	struct _ptouch_xfer *x;
+};
+
+static void LIBUSB_CALL ptouch_async_cb(struct libusb_transfer *t)
+{
+	struct _ptouch_async *a = t->user_data;
+
+	if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, _("write error: transfer status %i\n"), t->status);
+		a->error=1;
+	} else if (t->actual_length != t->length) {
+		fprintf(stderr, _("write error: could send only %i of %i bytes\n"), t->actual_length, t->length);
+		a->error=1;
+	}
+	for (int i=0; i<a->n; ++i) {
+		if (a->x[i].t == t) {
+			a->x[i].done=1;
+		}
+	}
+}
+
+static int ptouch_async_wait(ptouch_dev ptdev, struct _ptouch_xfer *x)
+{
+	int r;
+	double t0;
+
+	if (x->done) {
+		return 0;
+	}
+	t0=ptouch_seconds();
+	while (!x->done) {
+		if ((r=libusb_handle_events_completed(NULL, &x->done)) != 0) {
+			fprintf(stderr, _("libusb event error: %s\n"), libusb_error_name(r));
+			return -1;
+		}
+	}
+	ptdev->stats.tx_seconds += ptouch_seconds() - t0;
 	return 0;
 }
 
-int ptouch_send(ptouch_dev ptdev, uint8_t *data, size_t len)
+static void ptouch_async_free(struct _ptouch_async *a)
 {
-	int r, tx;
+	for (int i=0; i<a->n; ++i) {
+		libusb_free_transfer(a->x[i].t);
+		free(a->x[i].buf);
+	}
+	free(a->x);
+	free(a);
+}
+
+/* switch to async mode with a ring of ntransfers bulk out transfers */
+int ptouch_async_begin(ptouch_dev ptdev, int ntransfers)
+{
+	struct _ptouch_async *a;
 
 	if (!ptdev) {
-		fprintf(stderr, _("debug: called ptouch_send() with NULL ptdev\n"));
+		fprintf(stderr, _("debug: called ptouch_async_begin() with NULL ptdev\n"));
+		return -1;
+	}
+	if (ptdev->async) {
+		return 0;
+	}
+	if ((ptdev->tr != &usb_transport) || ptdev->raw_out || ptdev->recbuf) {
+		return -1;
+	}
+	if (ntransfers < 2) {
+		ntransfers=2;
+	}
+	if (ptouch_flush(ptdev) != 0) {
+		return -1;
+	}
+	if ((a=calloc(1, sizeof(struct _ptouch_async))) == NULL) {
 		return -1;
 	}
-	if (len > 128) {
+	if ((a->x=calloc(ntransfers, sizeof(struct _ptouch_xfer))) == NULL) {
+		free(a);
+		return -1;
+	}
+	a->n=ntransfers;
+	for (int i=0; i<a->n; ++i) {
+		a->x[i].done=1;
+		a->x[i].t=libusb_alloc_transfer(0);
+		a->x[i].buf=malloc(ptdev->txsize);
+		if ((a->x[i].t == NULL) || (a->x[i].buf == NULL)) {
+			ptouch_async_free(a);
+			return -1;
+		}
+	}
+	a->syncbuf=ptdev->txbuf;
+	ptdev->txbuf=a->x[0].buf;
+	ptdev->txlen=0;
+	ptdev->async=a;
+	return 0;
+}
+
+/* submit the buffered data and continue with the next free slot */
+int ptouch_async_submit(ptouch_dev ptdev)
+{
+	struct _ptouch_async *a;
+	struct _ptouch_xfer *x;
+	int r;
+
+	if (!ptdev || !ptdev->async) {
+		fprintf(stderr, _("debug: called ptouch_async_submit() without async mode\n"));
 		return -1;
 	}
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x02, data, (int)len, &tx, 0)) != 0) {
+	a=ptdev->async;
+	if (ptdev->txlen == 0) {
+		return a->error ? -1 : 0;
+	}
+	x=&a->x[a->cur];
+	libusb_fill_bulk_transfer(x->t, ptdev->h, 0x02, x->buf, (int)ptdev->txlen, ptouch_async_cb, a, ptdev->tx_timeout);
+	x->done=0;
+	if ((r=libusb_submit_transfer(x->t)) != 0) {
 		fprintf(stderr, _("write error: %s\n"), libusb_error_name(r));
+		x->done=1;
 		return -1;
 	}
-	if (tx != (int)len) {
-		fprintf(stderr, _("write error: could send only %i of %ld bytes\n"), tx, len);
+	ptdev->stats.transfers++;
+	ptdev->stats.bytes_out += ptdev->txlen;
+	a->cur=(a->cur + 1) % a->n;
+	x=&a->x[a->cur];
+	ptdev->txbuf=x->buf;
+	ptdev->txlen=0;
+	if (ptouch_async_wait(ptdev, x) != 0) {
+		return -1;
+	}
+	return a->error ? -1 : 0;
+}
+
+/* submit the buffered data and wait until all transfers are completed */
+int ptouch_async_drain(ptouch_dev ptdev)
+{
+	struct _ptouch_async *a;
+	int rc;
+
+	if (!ptdev || !ptdev->async) {
+		fprintf(stderr, _("debug: called ptouch_async_drain() without async mode\n"));
+		return -1;
+	}
+	a=ptdev->async;
+	rc=ptouch_async_submit(ptdev);
+	for (int i=0; i<a->n; ++i) {
+		if (ptouch_async_wait(ptdev, &a->x[i]) != 0) {
+			rc=-1;
+		}
+	}
+	if (a->error) {
+		a->error=0;
+		rc=-1;
+	}
+	return rc;
+}
+
+/* drain all transfers and switch back to sync mode */
+int ptouch_async_end(ptouch_dev ptdev)
+{
+	struct _ptouch_async *a;
+	int rc;
+
+	if (!ptdev || !ptdev->async) {
+		return 0;
+	}
+	a=ptdev->async;
+	rc=ptouch_async_drain(ptdev);
+	ptdev->txbuf=a->syncbuf;
+	ptdev->txlen=0;
+	ptdev->async=NULL;
+	ptouch_async_free(a);
+	return rc;
+}
+
+/* Start recording: everything passed to ptouch_send() is collected in
+   memory instead of being sent, until ptouch_record_end() is called.
+   The recorded data can later be sent (repeatedly) with ptouch_send(). */
+int ptouch_record_begin(ptouch_dev ptdev)
+{
+	if (!ptdev) {
+		fprintf(stderr, _("debug: called ptouch_record_begin() with NULL ptdev\n"));
+		return -1;
+	}
+	if (ptdev->recbuf) {
+		return -1;
+	}
+	if ((ptdev->recbuf=malloc(PTOUCH_TXBUF_SIZE)) == NULL) {
+		fprintf(stderr, _("out of memory\n"));
+		return -1;
+	}
+	ptdev->reclen=0;
+	ptdev->recsize=PTOUCH_TXBUF_SIZE;
+	return 0;
+}
+
+/* Stop recording and hand the recorded data over to the caller, who has
+   to free() it */
+int ptouch_record_end(ptouch_dev ptdev, uint8_t **data, size_t *len)
+{
+	if (!ptdev || !ptdev->recbuf) {
+		fprintf(stderr, _("debug: called ptouch_record_end() without recording\n"));
+		return -1;
+	}
+	*data=ptdev->recbuf;
+	*len=ptdev->reclen;
+	ptdev->recbuf=NULL;
+	ptdev->reclen=0;
+	ptdev->recsize=0;
+	return 0;
+}
+
+/* Write everything sent from now on to file ("-" for stdout) instead
+   of sending it to the printer, byte for byte as the printer would get
+   it, so it can be sent later as it is. The file is closed by
+   ptouch_close(). The status has to be read before, a status request
+   would end up in the file too. */
+int ptouch_redirect(ptouch_dev ptdev, const char *file)
+{
+	FILE *f;
+
+	if (!ptdev) {
+		fprintf(stderr, _("debug: called ptouch_redirect() with NULL ptdev\n"));
+		return -1;
+	}
+	if (ptdev->raw_out || ptdev->async || (ptouch_flush(ptdev) != 0)) {
+		return -1;
+	}
+	if ((f=strcmp(file, "-") ? fopen(file, "wb") : stdout) == NULL) {
+		fprintf(stderr, _("could not open '%s'\n"), file);
 		return -1;
 	}
+	ptdev->raw_out=f;
 	return 0;
 }
 
@@ -330,7 +1396,10 @@ int ptouch_finalize(ptouch_dev ptdev, int chain)
 
 	// The D460BT devices use a leading packet to indicate chaining instead.
 	char *cmd = (chain && (!(ptdev->devinfo->flags & FLAG_D460BT_MAGIC))) ? cmd_chain : cmd_eject;
-	return ptouch_send(ptdev, (uint8_t *)cmd, 1);
+	if (ptouch_send(ptdev, (uint8_t *)cmd, 1) != 0) {
+		return -1;
+	}
+	return ptouch_flush(ptdev);
 }
 
 
@@ -347,45 +1416,74 @@ void ptouch_rawstatus(uint8_t raw[32])
 	return;
 }
 
+/* take over a 32 byte status reply and look up the tape width */
+static void ptouch_setstatus(ptouch_dev ptdev, uint8_t buf[32])
+{
+	memcpy(ptdev->status, buf, 32);
+	ptdev->tape_width_px=0;
+	for (int i=0; tape_info[i].mm > 0; ++i) {
+		if (tape_info[i].mm == buf[10]) {
+			ptdev->tape_width_px=tape_info[i].px;
+		}
+	}
+	if (ptdev->tape_width_px == 0) {
+		fprintf(stderr, _("unknown tape width of %imm, please report this.\n"), buf[10]);
+	}
+}
+
+/* Request the status and wait for the reply. Every read has a real
+   timeout, so the reply is taken as soon as it arrives. Printers which
+   answer with empty reads are polled with a short, growing delay. */
 int ptouch_getstatus(ptouch_dev ptdev, int timeout)
 {
 	char cmd[]="\x1biS";	/* 1B 69 53 = ESC i S = Status info request */
 	uint8_t buf[32] = {};
-	int i, r, tx=0, tries=0, maxtries=timeout*10;
+	int r, tx=0;
+	long delay=1, deadline=0;
 	struct timespec w;
 
 	if (!ptdev) {
 		fprintf(stderr, _("debug: called ptouch_getstatus() with NULL ptdev\n"));
 		return -1;
 	}
+	if (ptdev->watch) {
+		fprintf(stderr, _("debug: called ptouch_getstatus() while watching the status\n"));
+		return -1;
+	}
 
 	ptouch_send(ptdev, (uint8_t *)cmd, strlen(cmd));
+	if (ptouch_flush(ptdev) != 0) {
+		return -1;
+	}
+	if (timeout) {
+		deadline=ptouch_now_ms() + (long)timeout*1000;
+	}
 	while (tx == 0) {
-		w.tv_sec=0;
-		w.tv_nsec=100000000;	/* 0.1 sec */
-		r=nanosleep(&w, NULL);
-		if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
+		r=ptdev->tr->read(ptdev, buf, 32, &tx, PTOUCH_STATUS_READ_TIMEOUT);
+		if ((r != 0) && (r != LIBUSB_ERROR_TIMEOUT)) {
 			fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
 			return -1;
 		}
-		++tries;
-		if (timeout && tries > maxtries) {
+		if (tx > 0) {
+			break;
+		}
+		if (deadline && (ptouch_now_ms() >= deadline)) {
 			fprintf(stderr, _("timeout (%i sec) while waiting for status response\n"), timeout);
 			return -1;
 		}
+		if (r == 0) {
+			/* empty read, the printer is not ready yet */
+			w.tv_sec=0;
+			w.tv_nsec=delay*1000000;
+			nanosleep(&w, NULL);
+			if (delay < PTOUCH_STATUS_READ_TIMEOUT) {
+				delay *= 2;
+			}
+		}
 	}
 	if (tx == 32) {
 		if (buf[0]==0x80 && buf[1]==0x20) {
-			memcpy(ptdev->status, buf, 32);
-			ptdev->tape_width_px=0;
-			for (i=0; tape_info[i].mm > 0; ++i) {
-				if (tape_info[i].mm == buf[10]) {
-					ptdev->tape_width_px=tape_info[i].px;
-				}
-			}
-			if (ptdev->tape_width_px == 0) {
-				fprintf(stderr, _("unknown tape width of %imm, please report this.\n"), buf[10]);
-			}
+			ptouch_setstatus(ptdev, buf);
 			return 0;
 		}
 	}
@@ -400,7 +1498,7 @@ int ptouch_getstatus(ptouch_dev ptdev, int timeout)
 	fprintf(stderr, _("strange status:\n"));
 	ptouch_rawstatus(buf);
 	fprintf(stderr, _("trying to flush junk\n"));
-	if ((r=libusb_bulk_transfer(ptdev->h, 0x81, buf, 32, &tx, 0)) != 0) {
+	if ((r=ptdev->tr->read(ptdev, buf, 32, &tx, PTOUCH_STATUS_READ_TIMEOUT)) != 0) {
 		fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
 		return -1;
 	}
@@ -408,6 +1506,127 @@ int ptouch_getstatus(ptouch_dev ptdev, int timeout)
 	return -1;
 }
 
+/* --------------------------------------------------------------------
+   Status watch: keeps an async read pending on the status endpoint, so
+   the status messages the printer sends on its own while printing
+   (phase changes, print completed, errors) can be picked up without
+   blocking. ptdev->status is updated with every message received.
+   -------------------------------------------------------------------- */
+
+struct _ptouch_watch {
+	struct libusb_transfer *t;
+	uint8_t buf[32];
+	int done;		/* 0 while the read is pending */
+};
+
+static void LIBUSB_CALL ptouch_watch_cb(struct libusb_transfer *t)
+{
+	struct _ptouch_watch *w = t->user_data;
+	w->done=1;
+}
+
+static int ptouch_watch_submit(ptouch_dev ptdev)
+{
+	struct _ptouch_watch *w = ptdev->watch;
+	int r;
+
+	libusb_fill_bulk_transfer(w->t, ptdev->h, 0x81, w->buf, sizeof(w->buf), ptouch_watch_cb, w, 0);
+	w->done=0;
+	if ((r=libusb_submit_transfer(w->t)) != 0) {
+		fprintf(stderr, _("read error: %s\n"), libusb_error_name(r));
+		w->done=1;
+		return -1;
+	}
+	return 0;
+}
+
+int ptouch_watch_begin(ptouch_dev ptdev)
+{
+	struct _ptouch_watch *w;
+
+	if (!ptdev) {
+		fprintf(stderr, _("debug: called ptouch_watch_begin() with NULL ptdev\n"));
+		return -1;
+	}
+	if (ptdev->watch) {
+		return 0;
+	}
+	if (ptdev->tr != &usb_transport) {
+		return -1;
+	}
+	if ((w=calloc(1, sizeof(struct _ptouch_watch))) == NULL) {
+		return -1;
+	}
+	if ((w->t=libusb_alloc_transfer(0)) == NULL) {
+		free(w);
+		return -1;
+	}
+	ptdev->watch=w;
+	if (ptouch_watch_submit(ptdev) != 0) {
+		ptouch_watch_end(ptdev);
+		return -1;
+	}
+	return 0;
+}
+
+/* Check for a status message without blocking. Returns 1 if a new
+   status was received (see ptdev->status->status_type), 0 if not and
+   -1 on error. */
+int ptouch_watch_poll(ptouch_dev ptdev)
+{
+	struct _ptouch_watch *w;
+	struct timeval tv = { 0, 0 };
+	int r, rc=0;
+
+	if (!ptdev || !ptdev->watch) {
+		fprintf(stderr, _("debug: called ptouch_watch_poll() without status watch\n"));
+		return -1;
+	}
+	w=ptdev->watch;
+	if ((r=libusb_handle_events_timeout_completed(NULL, &tv, &w->done)) != 0) {
+		fprintf(stderr, _("libusb event error: %s\n"), libusb_error_name(r));
+		return -1;
+	}
+	if (!w->done) {
+		return 0;
+	}
+	if (w->t->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, _("read error: transfer status %i\n"), w->t->status);
+		return -1;
+	}
+	if ((w->t->actual_length == 32) && (w->buf[0] == 0x80) && (w->buf[1] == 0x20)) {
+		ptouch_setstatus(ptdev, w->buf);
+		rc=1;
+	}
+	if (ptouch_watch_submit(ptdev) != 0) {
+		return -1;
+	}
+	return rc;
+}
+
+int ptouch_watch_end(ptouch_dev ptdev)
+{
+	struct _ptouch_watch *w;
+
+	if (!ptdev || !ptdev->watch) {
+		return 0;
+	}
+	w=ptdev->watch;
+	ptdev->watch=NULL;
+	if (!w->done) {
+		libusb_cancel_transfer(w->t);
+		while (!w->done) {
+			if (libusb_handle_events_completed(NULL, &w->done) != 0) {
+				/* the transfer still refers to w, so leak it */
+				return -1;
+			}
+		}
+	}
+	libusb_free_transfer(w->t);
+	free(w);
+	return 0;
+}
+
 size_t ptouch_get_tape_width(ptouch_dev ptdev)
 {
 	if (!ptdev) {
@@ -426,10 +1645,47 @@ size_t ptouch_get_max_width(ptouch_dev ptdev)
 	return ptdev->devinfo->max_px;
 }
 
+/* Compress len bytes from src into dst using the TIFF PackBits scheme.
+   A control byte n of 0..127 is followed by n+1 literal bytes, a control
+   byte of -1..-127 (as signed char) by one byte that is repeated 1-n
+   times. dst must have room for at least len + (len+127)/128 bytes.
+   Returns the number of bytes written to dst. */
+size_t ptouch_packbits(uint8_t *dst, const uint8_t *src, size_t len)
+{
+	size_t i = 0, o = 0;
+
+	while (i < len) {
+		size_t run = 1;
+		while ((i + run < len) && (run < 128) && (src[i + run] == src[i])) {
+			++run;
+		}
+		if (run >= 2) {
+			dst[o++] = (uint8_t)(257 - run);
+			dst[o++] = src[i];
+			i += run;
+			continue;
+		}
+		/* collect literals until a repeat of at least 3 bytes starts,
+		   since a 2 byte repeat does not save anything inside a literal */
+		size_t start = i, n = 0;
+		while ((i < len) && (n < 128)) {
+			if ((i + 2 < len) && (src[i] == src[i + 1]) && (src[i] == src[i + 2])) {
+				break;
+			}
+			++i;
+			++n;
+		}
+		dst[o++] = (uint8_t)(n - 1);
+		memcpy(dst + o, src + start, n);
+		o += n;
+	}
+	return o;
+}
+
 int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len)
 {
 	uint8_t buf[64];
-	int rc;
+	size_t i, n;
 
 	if (!ptdev) {
 		fprintf(stderr, _("debug: called ptouch_sendraster() with NULL ptdev\n"));
@@ -438,21 +1694,29 @@ int ptouch_sendraster(ptouch_dev ptdev, uint8_t *data, size_t len)
 	if (len > (size_t)(ptdev->devinfo->max_px / 8)) {
 		return -1;
 	}
-	buf[0]=0x47;
+	ptdev->stats.raster_lines++;
+	ptdev->stats.raster_raw += len;
 	if (ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) {
-		/* Fake compression by encoding a single uncompressed run */
-		buf[1] = (uint8_t)(len + 1);
-		buf[2] = 0;
-		buf[3] = (uint8_t)(len - 1);
-		memcpy(buf + 4, data, len);
-		rc = ptouch_send(ptdev, buf, len + 4);
-	} else {
-		buf[1] = (uint8_t)len;
-		buf[2] = 0;
-		memcpy(buf + 3, data, len);
-		rc = ptouch_send(ptdev, buf, len + 3);
+		/* a blank rasterline is sent as a single 'Z' */
+		for (i = 0; (i < len) && (data[i] == 0); ++i) {
+		}
+		if (i == len) {
+			ptdev->stats.raster_encoded++;
+			return ptouch_lf(ptdev);
+		}
+		n = ptouch_packbits(buf + 3, data, len);
+		buf[0] = 0x47;
+		buf[1] = (uint8_t)(n & 0xff);
+		buf[2] = (uint8_t)((n >> 8) & 0xff);
+		ptdev->stats.raster_encoded += n + 3;
+		return ptouch_send(ptdev, buf, n + 3);
 	}
-	return rc;
+	ptdev->stats.raster_encoded += len + 3;
+	buf[0] = 0x47;
+	buf[1] = (uint8_t)len;
+	buf[2] = 0;
+	memcpy(buf + 3, data, len);
+	return ptouch_send(ptdev, buf, len + 3);
 }
 
 void ptouch_list_supported()
@@ -0,0 +1,634 @@
+/*
+	ptouch-bench - benchmark the rendering and encoding paths of ptouch-print
+
+	Copyright (C) 2015-2024 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#define _GNU_SOURCE	/* RTLD_NEXT */
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc(), strtol() */
+#include <stdbool.h>
+#include <string.h>	/* memset(), strcmp() */
+#include <time.h>	/* clock_gettime() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* dup(), dup2(), getopt() */
+#include <gd.h>
+#ifdef __GLIBC__
+#include <dlfcn.h>	/* dlsym() */
+#include <stdatomic.h>
+#endif
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+/* the rendering functions read their options from here */
+struct arguments arguments = {
+	.align = ALIGN_LEFT,
+	.copies = 1,
+	.font_file = "Sans",
+};
+
+static const int widths[] = { 24, 76, 128, 384 };	/* tape widths in px */
+static const int lengths[] = { 256, 1024, 4096 };	/* label lengths in px */
+static double min_time = 0.2;	/* seconds each measurement runs at least */
+
+/* -------------------------------------------------------------------
+	allocation counting
+
+	On glibc malloc() and friends are interposed for the whole process,
+	so allocations done inside gd and FreeType are counted as well.
+	Elsewhere the counts are reported as n/a.
+   ------------------------------------------------------------------- */
+#ifdef __GLIBC__
+static _Atomic long alloc_count;
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static char boot_heap[4096];	/* serves dlsym() before the real functions are known */
+static size_t boot_used;
+static bool resolving;
+
+static void *boot_alloc(size_t size)
+{
+	size = (size + 15) & ~(size_t)15;
+	if (boot_used + size > sizeof(boot_heap)) {
+		return NULL;
+	}
+	void *p = boot_heap + boot_used;
+	boot_used += size;
+	return p;
+}
+
+static bool is_boot(void *ptr)
+{
+	return ((char *)ptr >= boot_heap) && ((char *)ptr < boot_heap + sizeof(boot_heap));
+}
+
+static void resolve_alloc(void)
+{
+	resolving = true;
+	real_malloc = dlsym(RTLD_NEXT, "malloc");
+	real_calloc = dlsym(RTLD_NEXT, "calloc");
+	real_realloc = dlsym(RTLD_NEXT, "realloc");
+	real_free = dlsym(RTLD_NEXT, "free");
+	resolving = false;
+}
+
+void *malloc(size_t size)
+{
+	if (!real_malloc) {
+		if (resolving) {
+			return boot_alloc(size);
+		}
+		resolve_alloc();
+	}
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return real_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	if (!real_calloc) {
+		if (resolving) {
+			return boot_alloc(nmemb * size);	/* boot_heap is zeroed */
+		}
+		resolve_alloc();
+	}
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return real_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (!real_realloc) {
+		resolve_alloc();
+	}
+	if (is_boot(ptr)) {
+		void *p = malloc(size);
+		if (p) {
+			size_t avail = (size_t)(boot_heap + sizeof(boot_heap) - (char *)ptr);
+			memcpy(p, ptr, (size < avail) ? size : avail);
+		}
+		return p;
+	}
+	atomic_fetch_add_explicit(&alloc_count, 1, memory_order_relaxed);
+	return real_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	if (!ptr || is_boot(ptr)) {
+		return;
+	}
+	if (!real_free) {
+		resolve_alloc();
+	}
+	real_free(ptr);
+}
+
+static long allocations(void)
+{
+	return atomic_load_explicit(&alloc_count, memory_order_relaxed);
+}
+#else
+static long allocations(void)
+{
+	return -1;
+}
+#endif
+
+/* -------------------------------------------------------------------
+	timing and reporting
+   ------------------------------------------------------------------- */
+typedef struct measurement {
+	long iterations;
+	double seconds;
+	long allocs;
+} measurement_t;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* print_img() and render_text() talk a lot, send that to /dev/null */
+static int quiet_fd = -1;
+
+static void quiet_begin(void)
+{
+	int fd = open("/dev/null", O_WRONLY);
+
+	fflush(stdout);
+	if (fd < 0) {
+		return;
+	}
+	quiet_fd = dup(STDOUT_FILENO);
+	dup2(fd, STDOUT_FILENO);
+	close(fd);
+}
+
+static void quiet_end(void)
+{
+	fflush(stdout);
+	if (quiet_fd >= 0) {
+		dup2(quiet_fd, STDOUT_FILENO);
+		close(quiet_fd);
+		quiet_fd = -1;
+	}
+}
+
+static void report(const char *stage, int width, int length, measurement_t *m, size_t bytes)
+{
+	double per_iter = m->seconds / (double)m->iterations;
+
+	printf("%-12s %5d %6d %10.1f %10.1f ", stage, width, length,
+		per_iter * 1e9 / (double)length,
+		(double)bytes / per_iter / 1e6);
+	if (m->allocs < 0) {
+		printf("%10s\n", "n/a");
+	} else {
+		printf("%10.1f\n", (double)m->allocs / (double)m->iterations);
+	}
+}
+
+/* -------------------------------------------------------------------
+	synthetic labels
+   ------------------------------------------------------------------- */
+
+/* a palette image of length x width px with a mix of solid areas,
+   stripes and blank columns, roughly what text labels look like */
+static gdImage *synthetic_label(int length, int width)
+{
+	gdImage *im = gdImageCreatePalette(length, width);
+
+	if (!im) {
+		return NULL;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	int black = gdImageColorAllocate(im, 0, 0, 0);
+	for (int x = 0; x < length; ++x) {
+		if ((x % 64) >= 56) {
+			continue;	/* gap between "characters" */
+		}
+		for (int y = width / 8; y < width - width / 8; ++y) {
+			if (((x / 4 + y / 3) % 5) < 2 || ((x % 64) < 6)) {
+				gdImageSetPixel(im, x, y, black);
+			}
+		}
+	}
+	return im;
+}
+
+/* text of about n characters */
+static void synthetic_text(char *buf, size_t size, int n)
+{
+	static const char sample[] = "The quick brown fox jumps over the lazy dog 0123456789 ";
+	size_t i;
+
+	for (i = 0; (i < (size_t)n) && (i + 1 < size); ++i) {
+		buf[i] = sample[i % (sizeof(sample) - 1)];
+	}
+	buf[i] = '\0';
+}
+
+/* -------------------------------------------------------------------
+	benchmarks
+   ------------------------------------------------------------------- */
+typedef int (*bench_fn)(void *ctx);
+
+static int run(bench_fn fn, void *ctx, measurement_t *m)
+{
+	long a0;
+	double t0, t;
+
+	/* one untimed round warms caches (fonts, metrics cache) */
+	if (fn(ctx) != 0) {
+		return -1;
+	}
+	m->iterations = 0;
+	a0 = allocations();
+	t0 = now();
+	do {
+		if (fn(ctx) != 0) {
+			return -1;
+		}
+		++m->iterations;
+		t = now();
+	} while (t - t0 < min_time);
+	m->seconds = t - t0;
+	m->allocs = (a0 < 0) ? -1 : allocations() - a0;
+	return 0;
+}
+
+typedef struct bench_ctx {
+	int width;
+	int length;
+	gdImage *im;
+	ptouch_bitmap bm;	/* im as bitmap */
+	char *text;
+	job_t *jobs;
+	ptouch_dev ptdev;
+	uint8_t *raster;	/* rasterized label, length * bpl bytes */
+	uint8_t *packed;
+	size_t bpl;
+	int out_length;	/* length of the last rendered image */
+} bench_ctx_t;
+
+static int bench_render_text(void *p)
+{
+	bench_ctx_t *ctx = p;
+	char *line[1] = { ctx->text };
+	gdImage *im = render_text(arguments.font_file, line, 1, ctx->width);
+
+	if (!im) {
+		return -1;
+	}
+	ctx->out_length = gdImageSX(im);
+	gdImageDestroy(im);
+	return 0;
+}
+
+static int bench_compose(void *p)
+{
+	bench_ctx_t *ctx = p;
+	ptouch_bitmap bm = NULL;
+
+	if ((compose_label(ctx->jobs, ctx->width, &bm) != 0) || !bm) {
+		return -1;
+	}
+	ctx->out_length = bm->length;
+	ptouch_bitmap_free(bm);
+	return 0;
+}
+
+static int bench_to_bitmap(void *p)
+{
+	bench_ctx_t *ctx = p;
+	ptouch_bitmap bm = image_to_bitmap(ctx->im);
+
+	if (!bm) {
+		return -1;
+	}
+	ptouch_bitmap_free(bm);
+	return 0;
+}
+
+static int bench_rasterlines(void *p)
+{
+	bench_ctx_t *ctx = p;
+	int offset = (int)(ctx->bpl * 4) - ctx->width / 2;
+
+	memset(ctx->raster, 0, (size_t)ctx->length * ctx->bpl);
+	for (int x = 0; x < ctx->length; ++x) {
+		ptouch_bitmap_line(ctx->bm, x, ctx->raster + (size_t)x * ctx->bpl, ctx->bpl, offset);
+	}
+	return 0;
+}
+
+static int bench_packbits(void *p)
+{
+	bench_ctx_t *ctx = p;
+
+	for (int x = 0; x < ctx->length; ++x) {
+		ptouch_packbits(ctx->packed, ctx->raster + (size_t)x * ctx->bpl, ctx->bpl);
+	}
+	return 0;
+}
+
+/* rasterlines for --invert, each one starts out from the window mask */
+static int bench_invert(void *p)
+{
+	bench_ctx_t *ctx = p;
+	int offset = (int)(ctx->bpl * 4) - ctx->width / 2;
+	uint8_t *line = ctx->raster;
+
+	ptouch_bitmap_window(ctx->packed, ctx->bpl, offset, ctx->width);
+	for (int x = 0; x < ctx->length; ++x, line += ctx->bpl) {
+		memcpy(line, ctx->packed, ctx->bpl);
+		ptouch_bitmap_line(ctx->bm, x, line, ctx->bpl, offset);
+	}
+	return 0;
+}
+
+static int bench_print(void *p)
+{
+	bench_ctx_t *ctx = p;
+
+	if (print_img(ctx->ptdev, ctx->bm, 0, 0, 0) != 0) {
+		return -1;
+	}
+	return ptouch_finalize(ctx->ptdev, 0);
+}
+
+/* virtual printer with a head wide enough for the given tape width */
+static int open_printer(ptouch_dev *ptdev, int width)
+{
+	char spec[64];
+	int mm = 0;
+
+	if (width > 128) {
+		/* no tape of the supported models reaches 384px, use the
+		   widest model and pretend the tape covers the whole head */
+		snprintf(spec, sizeof(spec), "out=/dev/null,model=PT-9200DX,tape=36");
+	} else {
+		mm = (width <= 24) ? 4 : ((width <= 76) ? 12 : 24);
+		snprintf(spec, sizeof(spec), "out=/dev/null,model=PT-P700,tape=%d", mm);
+	}
+	if (ptouch_open_virtual(ptdev, spec) != 0) {
+		return -1;
+	}
+	if ((ptouch_init(*ptdev) != 0) || (ptouch_getstatus(*ptdev, 1) != 0)) {
+		ptouch_free(*ptdev);
+		return -1;
+	}
+	if (width > 128) {
+		(*ptdev)->tape_width_px = width;
+	}
+	return 0;
+}
+
+static job_t *chain_jobs(char *text, int segments)
+{
+	job_t *head = NULL, **tail = &head;
+
+	for (int i = 0; i < segments; ++i) {
+		job_type_t types[3] = { JOB_TEXT, JOB_PAD, JOB_CUTMARK };
+		for (int k = 0; k < 3; ++k) {
+			job_t *job = calloc(1, sizeof(job_t));
+			if (!job) {
+				return head;
+			}
+			job->type = types[k];
+			job->n = (types[k] == JOB_PAD) ? 16 : 1;
+			job->lines[0] = text;
+			*tail = job;
+			tail = &job->next;
+		}
+	}
+	return head;
+}
+
+static void free_chain(job_t *job)
+{
+	while (job) {
+		job_t *next = job->next;
+		free(job);
+		job = next;
+	}
+}
+
+static int bench_width(int width, int length)
+{
+	bench_ctx_t ctx = { .width = width, .length = length };
+	measurement_t m;
+	char text[256];
+	int rc = 0;
+
+	/* the text length is chosen so the rendered label gets roughly
+	   as long as the synthetic one */
+	synthetic_text(text, sizeof(text), (length * 4) / width + 1);
+	ctx.text = text;
+	quiet_begin();
+	rc = run(bench_render_text, &ctx, &m);
+	quiet_end();
+	if (rc == 0) {
+		report("render_text", width, ctx.out_length, &m, (size_t)ctx.out_length * (size_t)((width + 7) / 8));
+	}
+	ctx.jobs = chain_jobs(text, 4);
+	quiet_begin();
+	rc = run(bench_compose, &ctx, &m);
+	quiet_end();
+	free_chain(ctx.jobs);
+	if (rc == 0) {
+		report("compose", width, ctx.out_length, &m, (size_t)ctx.out_length * (size_t)((width + 7) / 8));
+	}
+
+	if (open_printer(&ctx.ptdev, width) != 0) {
+		fprintf(stderr, "could not open virtual printer for %dpx\n", width);
+		return -1;
+	}
+	ctx.bpl = (size_t)ptouch_get_max_width(ctx.ptdev) / 8;
+	ctx.im = synthetic_label(length, width);
+	ctx.bm = ctx.im ? image_to_bitmap(ctx.im) : NULL;
+	ctx.raster = calloc((size_t)length, ctx.bpl);
+	ctx.packed = malloc(ctx.bpl * 2);
+	if (!ctx.im || !ctx.bm || !ctx.raster || !ctx.packed) {
+		fprintf(stderr, "Memory allocation failed\n");
+		rc = -1;
+	}
+	size_t bytes = (size_t)length * ctx.bpl;
+	if ((rc == 0) && (run(bench_to_bitmap, &ctx, &m) == 0)) {
+		report("to_bitmap", width, length, &m, (size_t)length * ctx.bm->bpl);
+	}
+	if ((rc == 0) && (run(bench_rasterlines, &ctx, &m) == 0)) {
+		report("rasterlines", width, length, &m, bytes);
+	}
+	if ((rc == 0) && (run(bench_packbits, &ctx, &m) == 0)) {
+		report("packbits", width, length, &m, bytes);
+	}
+	if ((rc == 0) && (run(bench_invert, &ctx, &m) == 0)) {
+		report("invert", width, length, &m, bytes);
+	}
+	if (rc == 0) {
+		quiet_begin();
+		rc = run(bench_print, &ctx, &m);
+		quiet_end();
+		if (rc == 0) {
+			report("print_img", width, length, &m, bytes);
+		}
+	}
+	if (ctx.im) {
+		gdImageDestroy(ctx.im);
+	}
+	ptouch_bitmap_free(ctx.bm);
+	free(ctx.raster);
+	free(ctx.packed);
+	ptouch_free(ctx.ptdev);
+	return rc;
+}
+
+/* -------------------------------------------------------------------
+	Render the numbers from..to (zero padded to digits) once with
+	render_glyphs() and once with render_text() at the same font size,
+	like the labels of --sequence are, and count the labels where the
+	two differ in length or in any pixel. Any such label is an error.
+   ------------------------------------------------------------------- */
+static int check_glyphs(int width, long from, long to, int digits)
+{
+	static char digit_chars[] = "-0123456789";
+	char text[32], *line[1] = { text };
+	int saved_size = arguments.font_size, differ = 0, rc = 0;
+	long first = 0;
+	glyph_cache_t *gc = NULL;
+
+	quiet_begin();
+	snprintf(text, sizeof(text), "%0*ld", digits, (labs(from) > labs(to)) ? from : to);
+	int fsz = fit_fontsize(arguments.font_file, line, 1, width);
+	int tall = find_fontsize(width, 0, arguments.font_file, digit_chars);
+	if ((tall > 0) && (tall < fsz)) {
+		fsz = tall;	/* like template_glyphs() */
+	}
+	if ((fsz <= 0) || ((gc = glyph_cache_new(arguments.font_file, fsz, digit_chars)) == NULL)) {
+		quiet_end();
+		fprintf(stderr, "could not set up the glyph cache for %dpx\n", width);
+		return -1;
+	}
+	arguments.font_size = fsz;
+	for (long i = from; (rc == 0) && (i <= to); ++i) {
+		ptouch_bitmap a = NULL, b = NULL;
+		gdImage *im;
+		snprintf(text, sizeof(text), "%0*ld", digits, i);
+		if ((render_glyphs(gc, line, 1, width, &a) != 0) ||
+		    ((im = render_text(arguments.font_file, line, 1, width)) == NULL)) {
+			rc = -1;
+		} else {
+			b = image_to_bitmap(im);
+			gdImageDestroy(im);
+		}
+		if (rc == 0) {
+			int x = 0;
+			if (b && (a->length == b->length)) {
+				while ((x < a->length) &&
+				       (memcmp(a->data + (size_t)x * a->bpl, b->data + (size_t)x * b->bpl, a->bpl) == 0)) {
+					++x;
+				}
+			}
+			if (!b || (a->length != b->length) || (x < a->length)) {
+				first = differ++ ? first : i;
+			}
+		}
+		ptouch_bitmap_free(a);
+		ptouch_bitmap_free(b);
+	}
+	arguments.font_size = saved_size;
+	glyph_cache_free(gc);
+	quiet_end();
+	if (rc == 0) {
+		printf("%-12s %5d %6d %ld labels, %d differ from render_text\n",
+			"glyphs", width, fsz, to - from + 1, differ);
+	}
+	if (differ) {
+		fprintf(stderr, "render_glyphs() differs from render_text() at %dpx, first for %0*ld\n",
+			width, digits, first);
+	}
+	return (rc == 0) && (differ == 0) ? 0 : -1;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-f font] [-t seconds] [-w width] [-s from:to]\n", name);
+	printf("\t-f font\t\tfont used for text rendering (default %s)\n", arguments.font_file);
+	printf("\t-t seconds\tminimum run time of each measurement (default %.1f)\n", min_time);
+	printf("\t-w width\tonly benchmark this tape width in px\n");
+	printf("\t-s from:to\tnumbers to compare render_glyphs() and render_text() with (default 0000:0999)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int c, only_width = 0, rc = 0, digits = 4;
+	long from = 0, to = 999;
+	char *end;
+
+	while ((c = getopt(argc, argv, "f:t:w:s:h")) != -1) {
+		switch (c) {
+			case 'f':
+				arguments.font_file = optarg;
+				break;
+			case 't':
+				min_time = strtod(optarg, NULL);
+				break;
+			case 'w':
+				only_width = atoi(optarg);
+				break;
+			case 's':
+				from = strtol(optarg, &end, 10);
+				digits = (int)(end - optarg) - (*optarg == '-');
+				if ((end == optarg) || (*end != ':') ||
+				    (to = strtol(end + 1, &end, 10), *end != '\0') || (from > to)) {
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			default:
+				usage(argv[0]);
+				return (c == 'h') ? 0 : 1;
+		}
+	}
+	printf("%-12s %5s %6s %10s %10s %10s\n", "stage", "width", "length", "ns/column", "MB/s", "allocs");
+	for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+		if (only_width && (only_width != widths[i])) {
+			continue;
+		}
+		for (size_t k = 0; k < sizeof(lengths) / sizeof(lengths[0]); ++k) {
+			if (bench_width(widths[i], lengths[k]) != 0) {
+				rc = 1;
+			}
+		}
+	}
+	for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); ++i) {
+		if ((only_width && (only_width != widths[i])) || (widths[i] > 128)) {
+			continue;
+		}
+		if (check_glyphs(widths[i], from, to, digits) != 0) {
+			rc = 1;
+		}
+	}
+	return rc;
+}
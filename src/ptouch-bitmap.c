@@ -0,0 +1,300 @@
+/*
+	ptouch-bitmap - 1 bit per pixel labels in the layout of the printer
+
+	Copyright (C) 2013-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdbool.h>
+#include <stdlib.h>	/* malloc() */
+#include <string.h>	/* memset() */
+
+#include "ptouch.h"
+
+/* Bits are numbered from the lowest bit of the last byte of a column,
+   so bit b lives in byte (bpl-1 - b/8) as 1 << (b%8). Pixel row y of a
+   bitmap is bit (width-1 - y), the top row is the highest bit. */
+
+/* OR (or XOR, if flip is set) the src_bpl bytes of src into dst,
+   moved up by shift bits. Bits which end up outside of dst, below or
+   above it, are dropped. */
+static void or_shifted(uint8_t *dst, size_t dst_bpl, const uint8_t *src, size_t src_bpl, int shift, bool flip)
+{
+	if (shift < 0) {
+		size_t q = (size_t)(-shift) / 8;
+		int s = (-shift) % 8;
+		for (size_t k = 0; (k + q < src_bpl) && (k < dst_bpl); ++k) {
+			uint8_t v = (uint8_t)(src[src_bpl-1 - (k + q)] >> s);
+			if (s && (k + q + 1 < src_bpl)) {
+				v |= (uint8_t)(src[src_bpl-1 - (k + q + 1)] << (8 - s));
+			}
+			if (flip) {
+				dst[dst_bpl-1 - k] ^= v;
+			} else {
+				dst[dst_bpl-1 - k] |= v;
+			}
+		}
+		return;
+	}
+	size_t q = (size_t)shift / 8;
+	int s = shift % 8;
+
+	for (size_t k = 0; (k < src_bpl) && (k + q < dst_bpl); ++k) {
+		uint8_t v = src[src_bpl-1 - k];
+		if (v == 0) {
+			continue;
+		}
+		uint8_t lo = (uint8_t)(v << s);
+		uint8_t hi = s ? (uint8_t)(v >> (8 - s)) : 0;
+		if (flip) {
+			dst[dst_bpl-1 - (k + q)] ^= lo;
+		} else {
+			dst[dst_bpl-1 - (k + q)] |= lo;
+		}
+		if (hi && (k + q + 1 < dst_bpl)) {
+			if (flip) {
+				dst[dst_bpl-1 - (k + q + 1)] ^= hi;
+			} else {
+				dst[dst_bpl-1 - (k + q + 1)] |= hi;
+			}
+		}
+	}
+}
+
+/* make room for at least length columns */
+static int ptouch_bitmap_reserve(ptouch_bitmap bm, int length)
+{
+	if (length <= bm->size) {
+		return 0;
+	}
+	int size = bm->size ? bm->size : 64;
+	while (size < length) {
+		size *= 2;
+	}
+	uint8_t *p = realloc(bm->data, (size_t)size * bm->bpl);
+	if (!p) {
+		return -1;
+	}
+	memset(p + (size_t)bm->size * bm->bpl, 0, (size_t)(size - bm->size) * bm->bpl);
+	bm->data = p;
+	bm->size = size;
+	return 0;
+}
+
+/* create a blank bitmap of length columns with width pixels each */
+ptouch_bitmap ptouch_bitmap_new(int length, int width)
+{
+	ptouch_bitmap bm;
+
+	if ((length < 0) || (width < 1)) {
+		return NULL;
+	}
+	if ((bm = calloc(1, sizeof(struct _ptouch_bitmap))) == NULL) {
+		return NULL;
+	}
+	bm->width = width;
+	bm->bpl = ((size_t)width + 7) / 8;
+	if (ptouch_bitmap_reserve(bm, length ? length : 1) != 0) {
+		free(bm);
+		return NULL;
+	}
+	bm->length = length;
+	return bm;
+}
+
+void ptouch_bitmap_free(ptouch_bitmap bm)
+{
+	if (bm) {
+		free(bm->data);
+		free(bm);
+	}
+}
+
+/* the bpl bytes of column x */
+uint8_t *ptouch_bitmap_column(ptouch_bitmap bm, int x)
+{
+	return bm->data + (size_t)x * bm->bpl;
+}
+
+int ptouch_bitmap_get(ptouch_bitmap bm, int x, int y)
+{
+	if ((x < 0) || (x >= bm->length) || (y < 0) || (y >= bm->width)) {
+		return 0;
+	}
+	int b = bm->width-1 - y;
+	return (ptouch_bitmap_column(bm, x)[bm->bpl-1 - b/8] >> (b%8)) & 1;
+}
+
+void ptouch_bitmap_set(ptouch_bitmap bm, int x, int y, int on)
+{
+	if ((x < 0) || (x >= bm->length) || (y < 0) || (y >= bm->width)) {
+		return;
+	}
+	int b = bm->width-1 - y;
+	uint8_t *p = &ptouch_bitmap_column(bm, x)[bm->bpl-1 - b/8];
+	if (on) {
+		*p |= (uint8_t)(1 << (b%8));
+	} else {
+		*p &= (uint8_t)~(1 << (b%8));
+	}
+}
+
+/* set the pixels of row y from n pixels packed 8 to a byte, the first
+   one in the highest bit, as in PBM files and 1 bit PNG rows. If flip
+   is set, the pixels with a 0 bit are set instead. */
+void ptouch_bitmap_set_row(ptouch_bitmap bm, int y, const uint8_t *row, int n, int flip)
+{
+	if ((y < 0) || (y >= bm->width)) {
+		return;
+	}
+	if (n > bm->length) {
+		n = bm->length;
+	}
+	int b = bm->width-1 - y;
+	uint8_t bit = (uint8_t)(1 << (b%8));
+	uint8_t *col = bm->data + (bm->bpl-1 - b/8);
+
+	for (int i = 0; i * 8 < n; ++i) {
+		unsigned v = flip ? (uint8_t)~row[i] : row[i];
+		if ((i + 1) * 8 > n) {
+			v &= 0xffu << ((i + 1) * 8 - n);	/* padding bits */
+		}
+		while (v) {
+			int x = i * 8 + 7 - __builtin_ctz(v);
+			col[(size_t)x * bm->bpl] |= bit;
+			v &= v - 1;
+		}
+	}
+}
+
+/* append n blank columns */
+int ptouch_bitmap_pad(ptouch_bitmap bm, int n)
+{
+	if (n < 0) {
+		return -1;
+	}
+	if (ptouch_bitmap_reserve(bm, bm->length + n) != 0) {
+		return -1;
+	}
+	bm->length += n;
+	return 0;
+}
+
+/* OR src into dst with its first column at column x and its top row
+   at the top row of dst. src must not be wider than dst, columns
+   beyond the end of dst are cut off. */
+int ptouch_bitmap_blit(ptouch_bitmap dst, int x, ptouch_bitmap src)
+{
+	int shift = dst->width - src->width;
+
+	if ((shift < 0) || (x < 0)) {
+		return -1;
+	}
+	for (int c = 0; (c < src->length) && (x + c < dst->length); ++c) {
+		or_shifted(ptouch_bitmap_column(dst, x + c), dst->bpl, ptouch_bitmap_column(src, c), src->bpl, shift, false);
+	}
+	return 0;
+}
+
+/* OR src into dst with its top left pixel at column x, row y. Pixels
+   outside of dst are cut off. */
+void ptouch_bitmap_draw(ptouch_bitmap dst, int x, int y, ptouch_bitmap src)
+{
+	int shift = dst->width - src->width - y;
+
+	for (int c = 0; (c < src->length) && (x + c < dst->length); ++c) {
+		if (x + c < 0) {
+			continue;
+		}
+		if ((y >= 0) && (shift >= 0)) {
+			or_shifted(ptouch_bitmap_column(dst, x + c), dst->bpl, ptouch_bitmap_column(src, c), src->bpl, shift, false);
+			continue;
+		}
+		for (int r = 0; r < src->width; ++r) {
+			if (ptouch_bitmap_get(src, c, r)) {
+				ptouch_bitmap_set(dst, x + c, y + r, 1);
+			}
+		}
+	}
+}
+
+/* add the columns of src at the end of dst */
+int ptouch_bitmap_append(ptouch_bitmap dst, ptouch_bitmap src)
+{
+	int x = dst->length;
+
+	if (src->width > dst->width) {
+		return -1;
+	}
+	if (ptouch_bitmap_pad(dst, src->length) != 0) {
+		return -1;
+	}
+	return ptouch_bitmap_blit(dst, x, src);
+}
+
+/* draw a dashed cut mark into column x, from the top down to row height-1 */
+void ptouch_bitmap_cutmark(ptouch_bitmap bm, int x, int height)
+{
+	for (int y = 0; y < height; ++y) {
+		if ((y % 6) >= 3) {
+			ptouch_bitmap_set(bm, x, y, 1);
+		}
+	}
+}
+
+/* turn every pixel of the bitmap from white to black and vice versa */
+void ptouch_bitmap_invert(ptouch_bitmap bm)
+{
+	/* the unused bits in the first byte of a column stay 0 */
+	uint8_t top = (bm->width % 8) ? (uint8_t)((1 << (bm->width % 8)) - 1) : 0xff;
+	uint8_t *p = bm->data;
+	uint8_t *end = bm->data + (size_t)bm->length * bm->bpl;
+
+	for (; p < end; p += bm->bpl) {
+		p[0] ^= top;
+		for (size_t k = 1; k < bm->bpl; ++k) {
+			p[k] ^= 0xff;
+		}
+	}
+}
+
+/* --------------------------------------------------------------------
+	Make the rasterline of column x for a print head with bpl bytes per
+	rasterline, with the bottom row of the bitmap placed offset pixels
+	from the bottom of the print head. The column is XORed into line,
+	so a zeroed line gives the column as it is and a line prepared by
+	ptouch_bitmap_window() gives it inverted. Pixels outside of the
+	print head, also below it with a negative offset, are dropped.
+   -------------------------------------------------------------------- */
+int ptouch_bitmap_line(ptouch_bitmap bm, int x, uint8_t *line, size_t bpl, int offset)
+{
+	if ((x < 0) || (x >= bm->length)) {
+		return -1;
+	}
+	or_shifted(line, bpl, ptouch_bitmap_column(bm, x), bm->bpl, offset, true);
+	return 0;
+}
+
+/* set the width pixels of line starting offset pixels from the bottom,
+   the mask to print a bitmap of that width inverted */
+void ptouch_bitmap_window(uint8_t *line, size_t bpl, int offset, int width)
+{
+	memset(line, 0, bpl);
+	for (int b = offset; (b < offset + width) && ((size_t)b < bpl * 8); ++b) {
+		if (b >= 0) {
+			line[bpl-1 - b/8] |= (uint8_t)(1 << (b%8));
+		}
+	}
+}
@@ -0,0 +1,220 @@
+/*
+	ptouch-cache - on-disk cache of encoded labels for ptouch-print
+
+	Copyright (C) 2015-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc() */
+#include <stdbool.h>
+#include <string.h>	/* strcmp(), memcmp() */
+#include <errno.h>
+#include <unistd.h>	/* close(), unlink() */
+#include <sys/stat.h>	/* stat(), mkdir() */
+#include <libintl.h>
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+#define _(s) gettext(s)
+
+#define CACHE_MAGIC "ptouch-print label cache 1\n"
+
+/* --------------------------------------------------------------------
+	Describe the printer and tape a label is made for, the first part
+	of its cache key. Returns a malloc()ed string or NULL.
+   -------------------------------------------------------------------- */
+char *label_cache_device(ptouch_dev ptdev, int print_width)
+{
+	char *dev = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&dev, &len);
+
+	if (!f) {
+		return NULL;
+	}
+	fprintf(f, "model %s %04x:%04x flags %x max_px %d tape_px %zu media %u/%u print_width %d\n",
+		ptdev->devinfo->name, ptdev->devinfo->vid, ptdev->devinfo->pid, ptdev->devinfo->flags,
+		ptdev->devinfo->max_px, ptouch_get_tape_width(ptdev),
+		ptdev->status->media_type, ptdev->status->media_width, print_width);
+	if (fclose(f) != 0) {
+		free(dev);
+		return NULL;
+	}
+	return dev;
+}
+
+/* --------------------------------------------------------------------
+	Describe everything that goes into the data print_img() sends for
+	a label: the printer (from label_cache_device()), the options used
+	for rendering, the template it is composed with (if tmpl is set)
+	and the jobs. A template renders its text at the font size of its
+	glyph cache instead of fitting it to every label. Image files are
+	described by name, size and modification time.
+	Returns a malloc()ed string, or NULL if the label can't be cached
+	(e.g. an image read from stdin).
+   -------------------------------------------------------------------- */
+char *label_cache_key(const char *device, job_t *job_list, const label_template_t *tmpl, bool chain, bool precut)
+{
+	char *key = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&key, &len);
+	bool ok = true;
+
+	if (!f) {
+		return NULL;
+	}
+	fputs(device, f);
+	fprintf(f, "font %s size %d max_length %d align %c invert %d chain %d precut %d\n",
+		arguments.font_file, arguments.font_size, arguments.max_length,
+		arguments.align, arguments.invert, chain, precut);
+	if (tmpl) {
+		fprintf(f, "template width %d offset %d invert %d parts %d\n",
+			tmpl->width, tmpl->offset, tmpl->invert, tmpl->nparts);
+		for (int i = 0; i < tmpl->nparts; ++i) {
+			const template_part_t *p = &tmpl->parts[i];
+			fprintf(f, "part %d variable %d glyphs %d\n",
+				p->njobs, p->variable, p->glyphs ? p->glyphs->fsz : 0);
+		}
+	}
+	for (job_t *job = job_list; ok && (job != NULL); job = job->next) {
+		struct stat st;
+		fprintf(f, "job %d %d\n", job->type, job->n);
+		switch (job->type) {
+			case JOB_TEXT:
+				for (int k = 0; (k < job->n) && (k < MAX_LINES) && job->lines[k]; ++k) {
+					fprintf(f, "%zu:%s\n", strlen(job->lines[k]), job->lines[k]);
+				}
+				break;
+			case JOB_IMAGE:
+				if (!strcmp(job->lines[0], "-") || (stat(job->lines[0], &st) != 0)) {
+					ok = false;
+					break;
+				}
+				fprintf(f, "%zu:%s %lld %lld.%09ld\n", strlen(job->lines[0]), job->lines[0],
+					(long long)st.st_size, (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+				break;
+			default:
+				break;
+		}
+	}
+	if ((fclose(f) != 0) || !ok) {
+		free(key);
+		return NULL;
+	}
+	return key;
+}
+
+/* file name of a key in the cache directory, a 64 bit FNV-1a hash of
+   the key. The key itself is stored in the file to rule out collisions. */
+static char *cache_path(const char *dir, const char *key)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t size = strlen(dir) + 32;
+	char *path = malloc(size);
+
+	for (const char *p = key; *p; ++p) {
+		h = (h ^ (uint8_t)*p) * 0x100000001b3ULL;
+	}
+	if (path) {
+		snprintf(path, size, "%s/%016llx.ptl", dir, (unsigned long long)h);
+	}
+	return path;
+}
+
+/* --------------------------------------------------------------------
+	Look up a label in the cache directory dir. On a hit, *data is the
+	malloc()ed data to send for one copy (without the final print
+	command) and *columns the length of the label.
+	Returns 0 on a hit, -1 otherwise.
+   -------------------------------------------------------------------- */
+int label_cache_get(const char *dir, const char *key, uint8_t **data, size_t *len, int *columns)
+{
+	char *path = cache_path(dir, key);
+	FILE *f = path ? fopen(path, "rb") : NULL;
+	char magic[sizeof(CACHE_MAGIC)];
+	size_t key_len = strlen(key), stored_len, data_len;
+	char *stored = NULL;
+	int rc = -1;
+
+	free(path);
+	if (!f) {
+		return -1;
+	}
+	*data = NULL;
+	if ((fread(magic, 1, sizeof(CACHE_MAGIC)-1, f) == sizeof(CACHE_MAGIC)-1) &&
+	    (memcmp(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)-1) == 0) &&
+	    (fscanf(f, "%zu %d %zu", &stored_len, columns, &data_len) == 3) &&
+	    (fgetc(f) == '\n') && (stored_len == key_len) &&
+	    ((stored = malloc(key_len)) != NULL) &&
+	    (fread(stored, 1, key_len, f) == key_len) &&
+	    (memcmp(stored, key, key_len) == 0) &&
+	    ((*data = malloc(data_len ? data_len : 1)) != NULL) &&
+	    (fread(*data, 1, data_len, f) == data_len)) {
+		*len = data_len;
+		rc = 0;
+	} else {
+		free(*data);
+		*data = NULL;
+	}
+	free(stored);
+	fclose(f);
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Store the data of a label in the cache directory dir (created if
+	needed). The file is written under a temporary name and renamed,
+	so other ptouch-print processes never see a partial entry.
+	Returns 0 on success, -1 on error.
+   -------------------------------------------------------------------- */
+int label_cache_put(const char *dir, const char *key, const uint8_t *data, size_t len, int columns)
+{
+	char *path = cache_path(dir, key);
+	char *tmp = path ? malloc(strlen(path) + 8) : NULL;
+	FILE *f = NULL;
+	int fd = -1, rc = -1;
+
+	if (!tmp) {
+		free(path);
+		return -1;
+	}
+	sprintf(tmp, "%s.XXXXXX", path);
+	if ((mkdir(dir, 0755) != 0) && (errno != EEXIST)) {
+		printf(_("could not create cache directory '%s': %s\n"), dir, strerror(errno));
+	} else if (((fd = mkstemp(tmp)) < 0) || ((f = fdopen(fd, "wb")) == NULL)) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(tmp);
+		}
+		printf(_("could not write to cache directory '%s'\n"), dir);
+	} else {
+		size_t key_len = strlen(key);
+		fchmod(fd, 0644);	/* like any other file, not 0600 as made by mkstemp() */
+		fputs(CACHE_MAGIC, f);
+		fprintf(f, "%zu %d %zu\n", key_len, columns, len);
+		fwrite(key, 1, key_len, f);
+		fwrite(data, 1, len, f);
+		if ((fclose(f) == 0) && (rename(tmp, path) == 0)) {
+			rc = 0;
+		} else {
+			unlink(tmp);
+		}
+	}
+	free(tmp);
+	free(path);
+	return rc;
+}
@@ -0,0 +1,319 @@
+/*
+	ptouch-image - load PNG and PBM images into bitmaps for ptouch-print
+
+	Copyright (C) 2015-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc() */
+#include <stdbool.h>
+#include <string.h>	/* strcmp(), memcmp() */
+#include <fcntl.h>	/* open() */
+#include <unistd.h>	/* read(), close() */
+#include <sys/mman.h>	/* mmap() */
+#include <sys/stat.h>	/* fstat() */
+#include <gd.h>
+#include <png.h>
+#include <libintl.h>
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+#define _(s) gettext(s)
+
+#define READ_CHUNK	65536
+
+/* the whole contents of an image file */
+typedef struct {
+	uint8_t *data;
+	size_t len;
+	bool mapped;	/* data is mmap()ed, otherwise malloc()ed */
+} image_file_t;
+
+/* --------------------------------------------------------------------
+	Get the contents of file ('-' is stdin) into memory. Regular files
+	are mapped, anything else (pipes, terminals) is read until EOF, so
+	the input never has to be seekable.
+   -------------------------------------------------------------------- */
+static int image_file_open(const char *file, image_file_t *img)
+{
+	struct stat st;
+	int fd = strcmp(file, "-") ? open(file, O_RDONLY) : STDIN_FILENO;
+
+	*img = (image_file_t){ NULL, 0, false };
+	if (fd < 0) {
+		return -1;
+	}
+	if ((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0)) {
+		void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			img->data = p;
+			img->len = (size_t)st.st_size;
+			img->mapped = true;
+		}
+	}
+	if (!img->mapped) {
+		size_t size = 0;
+		ssize_t n;
+		do {
+			if (img->len == size) {
+				uint8_t *p = realloc(img->data, size ? size * 2 : READ_CHUNK);
+				if (!p) {
+					n = -1;
+					break;
+				}
+				img->data = p;
+				size = size ? size * 2 : READ_CHUNK;
+			}
+			n = read(fd, img->data + img->len, size - img->len);
+			if (n > 0) {
+				img->len += (size_t)n;
+			}
+		} while (n > 0);
+		if (n < 0) {
+			free(img->data);
+			img->data = NULL;
+		}
+	}
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	return img->data ? 0 : -1;
+}
+
+static void image_file_close(image_file_t *img)
+{
+	if (img->mapped) {
+		munmap(img->data, img->len);
+	} else {
+		free(img->data);
+	}
+}
+
+/* skip whitespace and comments in a PBM header, then read a number */
+static int pbm_number(const uint8_t *d, size_t len, size_t *pos)
+{
+	size_t p = *pos;
+	int v = 0;
+
+	while (p < len) {
+		if (d[p] == '#') {
+			while ((p < len) && (d[p] != '\n')) {
+				++p;
+			}
+		} else if ((d[p] == ' ') || (d[p] == '\t') || (d[p] == '\r') || (d[p] == '\n')) {
+			++p;
+		} else {
+			break;
+		}
+	}
+	if ((p >= len) || (d[p] < '0') || (d[p] > '9')) {
+		return -1;
+	}
+	while ((p < len) && (d[p] >= '0') && (d[p] <= '9')) {
+		if (v > 100000) {
+			return -1;
+		}
+		v = v * 10 + (d[p++] - '0');
+	}
+	*pos = p;
+	return v;
+}
+
+/* --------------------------------------------------------------------
+	Load a binary PBM (P4). Its rows are already packed 1 bit per pixel
+	with 1 for black, so they go into the bitmap as they are.
+   -------------------------------------------------------------------- */
+static ptouch_bitmap pbm_load(const uint8_t *d, size_t len)
+{
+	size_t pos = 2;
+	int w = pbm_number(d, len, &pos);
+	int h = pbm_number(d, len, &pos);
+
+	if ((w < 1) || (h < 1) || (pos >= len)) {
+		return NULL;
+	}
+	++pos;	/* the single whitespace before the raster */
+	size_t row_len = ((size_t)w + 7) / 8;
+	if ((len - pos) / row_len < (size_t)h) {
+		printf(_("image file is truncated\n"));
+		return NULL;
+	}
+	ptouch_bitmap bm = ptouch_bitmap_new(w, h);
+	if (!bm) {
+		return NULL;
+	}
+	for (int y = 0; y < h; ++y) {
+		ptouch_bitmap_set_row(bm, y, d + pos + (size_t)y * row_len, w, 0);
+	}
+	return bm;
+}
+
+/* state of a PNG being decoded by the progressive reader of libpng */
+typedef struct {
+	ptouch_bitmap bm;
+	int depth;	/* bits per pixel of the rows handed to row_cb */
+	int dark;	/* the pixel value to print */
+	uint8_t *packed;	/* one row packed 1 bit per pixel */
+	bool done;	/* the end of the image was reached */
+} png_load_t;
+
+static void png_info_cb(png_structp png, png_infop info)
+{
+	png_load_t *pl = png_get_progressive_ptr(png);
+	png_uint_32 w, h;
+	int depth, color_type;
+
+	png_get_IHDR(png, info, &w, &h, &depth, &color_type, NULL, NULL, NULL);
+	pl->dark = 0;
+	if (color_type == PNG_COLOR_TYPE_PALETTE) {
+		/* like gd, print the darker one of the colors 0 and 1,
+		   missing palette entries are black */
+		png_colorp pal = NULL;
+		int npal = 0;
+		int lum[2] = { 0, 0 };
+		png_get_PLTE(png, info, &pal, &npal);
+		for (int i = 0; (i < 2) && (i < npal); ++i) {
+			lum[i] = pal[i].red + pal[i].green + pal[i].blue;
+		}
+		pl->dark = (lum[1] < lum[0]) ? 1 : 0;
+	}
+	if (depth == 16) {
+		png_set_strip_16(png);
+	} else if ((depth == 2) || (depth == 4)) {
+		png_set_packing(png);
+	}
+	png_read_update_info(png, info);
+	pl->depth = (depth == 1) ? 1 : 8;
+	if ((w > 100000) || (h > 100000) ||
+	    ((pl->bm = ptouch_bitmap_new((int)w, (int)h)) == NULL) ||
+	    ((pl->packed = calloc(1, (w + 7) / 8)) == NULL)) {
+		png_error(png, "out of memory");
+	}
+}
+
+static void png_row_cb(png_structp png, png_bytep row, png_uint_32 y, int pass)
+{
+	png_load_t *pl = png_get_progressive_ptr(png);
+	int w = pl->bm->length;
+
+	(void)pass;
+	if (!row) {
+		return;
+	}
+	if (pl->depth == 1) {
+		ptouch_bitmap_set_row(pl->bm, (int)y, row, w, (pl->dark == 0));
+		return;
+	}
+	memset(pl->packed, 0, ((size_t)w + 7) / 8);
+	for (int x = 0; x < w; ++x) {
+		if (row[x] == pl->dark) {
+			pl->packed[x/8] |= (uint8_t)(0x80 >> (x%8));
+		}
+	}
+	ptouch_bitmap_set_row(pl->bm, (int)y, pl->packed, w, 0);
+}
+
+static void png_end_cb(png_structp png, png_infop info)
+{
+	png_load_t *pl = png_get_progressive_ptr(png);
+
+	(void)info;
+	pl->done = true;
+}
+
+/* --------------------------------------------------------------------
+	Decode a grayscale or palette PNG straight into a bitmap, one row
+	at a time as libpng hands them out. The pixels printed are the
+	same that gd and image_to_bitmap() would print: black for
+	grayscale images, the darker one of the colors 0 and 1 for palette
+	images.
+   -------------------------------------------------------------------- */
+static ptouch_bitmap png_load_bilevel(const uint8_t *d, size_t len)
+{
+	png_load_t pl = { NULL, 0, 0, NULL, false };
+	png_load_t *volatile plp = &pl;
+	png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_infop info = png ? png_create_info_struct(png) : NULL;
+	ptouch_bitmap bm = NULL;
+
+	if (!info) {
+		png_destroy_read_struct(&png, NULL, NULL);
+		return NULL;
+	}
+	if (setjmp(png_jmpbuf(png))) {
+		ptouch_bitmap_free(plp->bm);
+		plp->bm = NULL;
+	} else {
+		png_set_progressive_read_fn(png, plp, png_info_cb, png_row_cb, png_end_cb);
+		png_process_data(png, info, (png_bytep)d, len);
+		if (!plp->done) {
+			printf(_("image file is truncated\n"));
+			ptouch_bitmap_free(plp->bm);
+			plp->bm = NULL;
+		}
+	}
+	bm = plp->bm;
+	free(plp->packed);
+	png_destroy_read_struct(&png, &info, NULL);
+	return bm;
+}
+
+/* --------------------------------------------------------------------
+	Decode any other PNG with gd
+   -------------------------------------------------------------------- */
+static ptouch_bitmap png_load_gd(const uint8_t *d, size_t len)
+{
+	gdImage *im = gdImageCreateFromPngPtr((int)len, (void *)d);
+	ptouch_bitmap bm = image_to_bitmap(im);
+
+	if (im) {
+		gdImageDestroy(im);
+	}
+	return bm;
+}
+
+/* --------------------------------------------------------------------
+	Load a PNG or binary PBM image file ('-' is stdin) as a bitmap.
+	Grayscale and palette PNGs are decoded directly by libpng, which
+	is the common case for label images, all other PNGs go through gd.
+   -------------------------------------------------------------------- */
+ptouch_bitmap image_load(const char *file)
+{
+	const uint8_t png[8] = {0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
+	image_file_t img;
+	ptouch_bitmap bm = NULL;
+
+	if (image_file_open(file, &img) != 0) {
+		return NULL;
+	}
+	if ((img.len >= 29) && (memcmp(img.data, png, 8) == 0)) {
+		/* IHDR is always the first chunk, look at color type and
+		   interlacing before choosing the decoder */
+		int color_type = img.data[25];
+		int interlace = img.data[28];
+		if (((color_type == PNG_COLOR_TYPE_GRAY) || (color_type == PNG_COLOR_TYPE_PALETTE)) &&
+		    (interlace == PNG_INTERLACE_NONE)) {
+			bm = png_load_bilevel(img.data, img.len);
+		} else {
+			bm = png_load_gd(img.data, img.len);
+		}
+	} else if ((img.len >= 3) && (img.data[0] == 'P') && (img.data[1] == '4')) {
+		bm = pbm_load(img.data, img.len);
+	}
+	image_file_close(&img);
+	return bm;
+}
@@ -24,61 +24,68 @@
 #include <stdbool.h>
 #include <string.h>	/* strcmp(), memcmp() */
 #include <sys/types.h>	/* open() */
-#include <sys/stat.h>	/* open() */
+#include <sys/stat.h>	/* open(), fstat() */
+#include <sys/mman.h>	/* mmap() */
 #include <fcntl.h>	/* open() */
+#include <signal.h>	/* signal() */
+#include <sys/socket.h>	/* socket(), bind(), listen(), accept() */
+#include <sys/un.h>	/* struct sockaddr_un */
+#include <unistd.h>	/* read(), close(), unlink() */
+#include <poll.h>	/* poll() */
 #include <gd.h>
 #include <libintl.h>
 #include <locale.h>	/* LC_ALL */
+#include <pthread.h>
 
 #include "version.h"
 #include "ptouch.h"
+#include "ptouch-render.h"
 
 #define _(s) gettext(s)
 
-#define MAX_LINES 8	/* maybe this should depend on tape size */
+#define MAX_REQUEST (1024*1024)	/* maximum size of a job sent to the daemon */
+#define REQUEST_TIMEOUT 10	/* seconds a client has to send its whole job */
+#define MAX_PRINTERS 16	/* maximum number of printers used with --all-printers */
+#define BATCH_CHUNK 64	/* labels composed before they are spread over several printers */
+#define MAX_RENDER_THREADS 16	/* maximum number of threads rendering batch labels */
+#define MAX_FIELDS 64	/* maximum number of fields of a batch record used by a template */
 
 #define P_NAME "ptouch-print"
 
-typedef enum { ALIGN_LEFT = 'l', ALIGN_CENTER = 'c', ALIGN_RIGHT = 'r' } align_type_t;
-
-struct arguments {
-	align_type_t align;
-	bool chain;
-	bool precut;
-	int copies;
-	bool debug;
-	bool info;
-	bool invert;
-	char *font_file;
-	int font_size;
-	int forced_tape_width;
-	char *save_png;
-	int verbose;
-	int timeout;
+/* a label is LABEL_FAILED if it was sent, but the printer did not take
+   the print command; it is not printed again to rule out duplicates */
+typedef enum { LABEL_PENDING, LABEL_TAKEN, LABEL_DONE, LABEL_FAILED } label_state_t;
+
+/* one label of a batch printed with dispatch_labels() */
+typedef struct batch_label {
+	ptouch_bitmap bm;
+	uint8_t media_width;	/* tape width needed in mm, 0 for any */
+	uint8_t tape_color;	/* tape color needed, 0 for any */
+	label_state_t state;
+} batch_label_t;
+
+/* the numbers printed with --sequence */
+struct sequence {
+	long start;
+	long step;
+	unsigned long count;	/* number of labels */
+	int digits;	/* numbers are padded with zeros to this many digits */
 };
-typedef enum { JOB_CUTMARK, JOB_IMAGE, JOB_PAD, JOB_TEXT, JOB_UNDEFINED } job_type_t;
 
-typedef struct job {
-	job_type_t type;
-	int n;
-	char *lines[MAX_LINES];
-	struct job *next;
-} job_t;
-
-gdImage *image_load(const char *file);
-void rasterline_setpixel(uint8_t* rasterline, size_t size, int pixel);
-int get_baselineoffset(char *text, char *font, int fsz);
-int find_fontsize(int want_px, char *font, char *text);
-int needed_width(char *text, char *font, int fsz);
-int print_img(ptouch_dev ptdev, gdImage *im, int chain, int precut);
-int write_png(gdImage *im, const char *file);
-gdImage *img_append(gdImage *in_1, gdImage *in_2);
-gdImage *img_cutmark(int print_width);
-gdImage *render_text(char *font, char *line[], int lines, int print_width);
-void invert_image(gdImage *im);
 void unsupported_printer(ptouch_dev ptdev);
 void add_job(job_type_t type, int n, char *line);
-void add_text(struct argp_state *state, char *arg, bool new_job);
+int add_text(char *arg, bool new_job);
+void free_jobs(void);
+void free_job_list(job_t *list);
+void list_printers(void);
+int dispatch_labels(batch_label_t *labels, int n, ptouch_dev *devs, int ndevs);
+int print_label(ptouch_dev *devs, int ndevs, int print_width);
+int run_daemon(ptouch_dev *devp, int print_width, const char *path);
+int run_batch(ptouch_dev *devs, int ndevs, int print_width, const char *path);
+int send_raw(ptouch_dev ptdev, const char *path);
+void print_stats(ptouch_dev *devs, int ndevs, double seconds);
+static int print_copies(ptouch_dev ptdev, ptouch_bitmap bm, const char *key, label_template_t *t, const int *part_len);
+static int send_copies(ptouch_dev ptdev, uint8_t *raster, size_t raster_len, int columns);
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
 
 const char *argp_program_version = P_NAME " " VERSION;
@@ -92,13 +99,22 @@ static struct argp_option options[] = {
 	{ "invert", 30, 0, 0, "Invert output (print white on black background)", 1},
 	{ "font", 2, "<file>", 0, "Use font <file> or <name>", 1},
 	{ "fontsize", 3, "<size>", 0, "Manually set font size", 1},
+	{ "max-length", 8, "<px>", 0, "Choose the font size so that text is at most <px> pixels long", 1},
 	{ "writepng", 4, "<file>", 0, "Instead of printing, write output to png <file>", 1},
+	{ "write-raw", 16, "<file>", 0, "Instead of printing, write the data the printer would get to <file>", 1},
+	{ "send-raw", 17, "<file>", 0, "Send <file> made with --write-raw to the printer as it is", 1},
 	{ "force-tape-width", 5, "<px>", 0, "Set tape width in pixels, use together with --writepng without a printer connected", 1},
 	{ "copies", 6, "<number>", 0, "Sets the number of identical prints", 1},
 	{ "timeout", 7, "<seconds>", 0, "Set timeout waiting for finishing previous job. Default:1, 0 means infinity", 1},
+	{ "wait", 18, "<seconds>", OPTION_ARG_OPTIONAL, "Wait until the printer is connected or switched on, at most <seconds>", 1},
+	{ "printer", 9, "<bus:addr|bus-port|serial>", 0, "Use the printer at the given USB location or with the given serial number", 1},
+	{ "all-printers", 12, 0, 0, "Spread the copies over all connected printers with the same tape", 1},
+	{ "virtual", 13, "<spec>", 0, "Print to a virtual printer which records the data, e.g. out=<file>,model=PT-P700,tape=24", 1},
+	{ "stats", 14, "<text|json>", OPTION_ARG_OPTIONAL, "Print the time spent in each phase and the amount of data sent to stderr", 1},
+	{ "cache-dir", 15, "<dir>", 0, "Keep the printer data of every label in <dir> and reuse it to print identical labels", 1},
 
 	{ 0, 0, 0, 0, "print commands:", 2},
-	{ "image", 'i', "<file>", 0, "Print the given image which must be a 2 color (black/white) png", 2},
+	{ "image", 'i', "<file>", 0, "Print the given image which must be a 2 color (black/white) png or pbm", 2},
 	{ "text", 't', "<text>", 0, "Print line of <text>. If the text contains spaces, use quotation marks around it. \\n will be replaced by a newline", 2},
 	{ "cutmark", 'c', 0, 0, "Print a mark where the tape should be cut", 2},
 	{ "pad", 'p', "<n>", 0, "Add n pixels padding (blank tape)", 2},
@@ -110,6 +126,12 @@ static struct argp_option options[] = {
 	{ 0, 0, 0, 0, "other commands:", 3},
 	{ "info", 20, 0, 0, "Show info about detected tape", 3},
 	{ "list-supported", 21, 0, 0, "Show printers supported by this version", 3},
+	{ "list-printers", 23, 0, 0, "Show all connected printers", 3},
+	{ "daemon", 22, "<socket>", 0, "Keep the printer open and print jobs received on unix socket <socket>", 3},
+	{ "batch", 24, "<file>", 0, "Print one label for every record read from <file> (- for stdin)", 3},
+	{ "batch-format", 25, "<csv|tsv|jobs>", 0, "Format of the batch file. Default: csv", 3},
+	{ "render-threads", 26, "<n>", 0, "Number of threads rendering batch labels. Default: number of CPUs", 3},
+	{ "sequence", 27, "<start:end[:step]>", 0, "Print one label for every number from start to end, put into {1} of the print commands", 3},
 	{ 0 }
 };
 
@@ -126,412 +148,31 @@ struct arguments arguments = {
 	//.font_file = "Ubuntu:medium",
 	.font_file = "Sans",
 	.font_size = 0,
+	.max_length = 0,
 	.forced_tape_width = 0,
 	.save_png = NULL,
+	.write_raw = NULL,
+	.send_raw = NULL,
+	.daemon_socket = NULL,
+	.printer = NULL,
+	.virtual_printer = NULL,
+	.all_printers = false,
+	.stats = STATS_OFF,
+	.batch_file = NULL,
+	.batch_format = BATCH_CSV,
+	.render_threads = 0,
+	.sequence = NULL,
+	.cache_dir = NULL,
 	.verbose = 0,
-	.timeout = 1
+	.timeout = 1,
+	.wait = -1
 };
 
 job_t *jobs = NULL;
+static struct sequence sequence;
+unsigned long printed_columns = 0;	/* label length printed, for --stats */
 job_t *last_added_job = NULL;
 
-/* --------------------------------------------------------------------
-   -------------------------------------------------------------------- */
-
-void rasterline_setpixel(uint8_t* rasterline, size_t size, int pixel)
-{
-//	TODO: pixel should be unsigned, since we can't have negative
-//	if (pixel > ptdev->devinfo->device_max_px) {
-	if ((pixel < 0) || (pixel >= (int)(size*8))) {
-		return;
-	}
-	rasterline[(size-1)-(pixel/8)] |= (uint8_t)(1<<(pixel%8));
-	return;
-}
-
-int print_img(ptouch_dev ptdev, gdImage *im, int chain, int precut)
-{
-	uint8_t rasterline[(ptdev->devinfo->max_px)/8];
-
-	if (!im) {
-		printf(_("nothing to print\n"));
-		return -1;
-	}
-	int tape_width = ptouch_get_tape_width(ptdev);
-	size_t max_pixels = ptouch_get_max_width(ptdev);
-	/* find out whether color 0 or color 1 is darker */
-	int d = (gdImageRed(im,1) + gdImageGreen(im,1) + gdImageBlue(im,1) < gdImageRed(im,0) + gdImageGreen(im,0) + gdImageBlue(im,0))?1:0;
-	if (gdImageSY(im) > tape_width) {
-		printf(_("image is too large (%ipx x %ipx)\n"), gdImageSX(im), gdImageSY(im));
-		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
-		return -1;
-	}
-	printf(_("image size (%ipx x %ipx)\n"), gdImageSX(im), gdImageSY(im));
-	int offset = ((int)max_pixels / 2) - (gdImageSY(im)/2);	/* always print centered */
-	printf("max_pixels=%ld, offset=%d\n", max_pixels, offset);
-	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
-		if (arguments.debug) {
-			printf("enable PackBits mode\n");
-		}
-		ptouch_enable_packbits(ptdev);
-	}
-	if (ptouch_rasterstart(ptdev) != 0) {
-		printf(_("ptouch_rasterstart() failed\n"));
-		return -1;
-	}
-	if ((ptdev->devinfo->flags & FLAG_USE_INFO_CMD) == FLAG_USE_INFO_CMD) {
-		ptouch_info_cmd(ptdev, gdImageSX(im));
-		if (arguments.debug) {
-			printf(_("send print information command\n"));
-		}
-	}
-	if ((ptdev->devinfo->flags & FLAG_D460BT_MAGIC) == FLAG_D460BT_MAGIC) {
-		ptouch_send_d460bt_magic(ptdev);
-		if (arguments.debug) {
-			printf(_("send PT-D460BT magic commands\n"));
-		}
-	}
-	if ((ptdev->devinfo->flags & FLAG_HAS_PRECUT) == FLAG_HAS_PRECUT) {
-		if (precut) {
-			ptouch_send_precut_cmd(ptdev, 1);
-			if (arguments.debug) {
-				printf(_("send precut command\n"));
-			}
-		}
-	}
-	/* send chain command after precut, to allow precutting before chain */
-	if ((ptdev->devinfo->flags & FLAG_D460BT_MAGIC) == FLAG_D460BT_MAGIC) {
-		if (chain) {
-			ptouch_send_d460bt_chain(ptdev);
-			if (arguments.debug) {
-				printf(_("send PT-D460BT chain commands\n"));
-			}
-		}
-	}
-	for (int k = 0; k < gdImageSX(im); ++k) {
-		memset(rasterline, 0, sizeof(rasterline));
-		for (int i = 0; i < gdImageSY(im); ++i) {
-			if (gdImageGetPixel(im, k, gdImageSY(im) - 1 - i) == d) {
-				rasterline_setpixel(rasterline, sizeof(rasterline), offset+i);
-			}
-		}
-		if (ptouch_sendraster(ptdev, rasterline, (ptdev->devinfo->max_px / 8)) != 0) {
-			printf(_("ptouch_sendraster() failed\n"));
-			return -1;
-		}
-	}
-	return 0;
-}
-
-/* --------------------------------------------------------------------
-	Function	image_load()
-	Description	detect the type of a image and try to load it
-	Last update	2005-10-16
-	Status		Working, should add debug info
-   -------------------------------------------------------------------- */
-
-gdImage *image_load(const char *file)
-{
-	const uint8_t png[8] = {0x89,'P','N','G',0x0d,0x0a,0x1a,0x0a};
-	char d[10];
-	FILE *f;
-	gdImage *img = NULL;
-
-	if (!strcmp(file, "-")) {
-		f = stdin;
-	} else {
-		f = fopen(file, "rb");
-	}
-	if (f == NULL) {	/* error could not open file */
-		return NULL;
-	}
-	if (fseek(f, 0L, SEEK_SET)) {	/* file is not seekable. eg 'stdin' */
-		img = gdImageCreateFromPng(f);
-	} else {
-		if (fread(d, sizeof(d), 1, f) != 1) {
-			return NULL;
-		}
-		rewind(f);
-		if (memcmp(d, png, 8) == 0) {
-			img = gdImageCreateFromPng(f);
-		}
-	}
-	fclose(f);
-	return img;
-}
-
-int write_png(gdImage *im, const char *file)
-{
-	FILE *f;
-
-	if ((f = fopen(file, "wb")) == NULL) {
-		printf(_("writing image '%s' failed\n"), file);
-		return -1;
-	}
-	gdImagePng(im, f);
-	fclose(f);
-	return 0;
-}
-
-/* --------------------------------------------------------------------
-	Find out the difference in pixels between a "normal" char and one
-	that goes below the font baseline
-   -------------------------------------------------------------------- */
-int get_baselineoffset(char *text, char *font, int fsz)
-{
-	int brect[8];
-
-	/* NOTE: This assumes that 'o' is always on the baseline */
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, "o");
-	int o_offset = brect[1];
-	gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text);
-	int text_offset = brect[1];
-	if (arguments.debug) {
-		printf(_("debug: o baseline offset - %d\n"), o_offset);
-		printf(_("debug: text baseline offset - %d\n"), text_offset);
-	}
-	return text_offset-o_offset;
-}
-
-/* --------------------------------------------------------------------
-	Find out which fontsize we need for a given font to get a
-	specified pixel size
-	NOTE: This does NOT work for some UTF-8 chars like µ
-   -------------------------------------------------------------------- */
-int find_fontsize(int want_px, char *font, char *text)
-{
-	int save = 0;
-	int brect[8];
-
-	for (int i=4; ; ++i) {
-		if (gdImageStringFT(NULL, &brect[0], -1, font, i, 0.0, 0, 0, text) != NULL) {
-			break;
-		}
-		if (brect[1]-brect[5] <= want_px) {
-			save = i;
-		} else {
-			break;
-		}
-	}
-	if (save == 0) {
-		return -1;
-	}
-	return save;
-}
-
-int needed_width(char *text, char *font, int fsz)
-{
-	int brect[8];
-
-	if (gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text) != NULL) {
-		return -1;
-	}
-	return brect[2]-brect[0];
-}
-
-int offset_x(char *text, char *font, int fsz)
-{
-	int brect[8];
-
-	if (gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text) != NULL) {
-		return -1;
-	}
-	return -brect[0];
-}
-
-gdImage *render_text(char *font, char *line[], int lines, int print_width)
-{
-	int brect[8];
-	int i, black, x = 0, tmp = 0, fsz = 0;
-	char *p;
-	gdImage *im = NULL;
-
-	if (arguments.debug) {
-		printf(_("render_text(): %i lines, font = '%s', align = '%c'\n"), lines, font, arguments.align);
-	}
-	if (gdFTUseFontConfig(1) != GD_TRUE) {
-		printf(_("warning: font config not available\n"));
-	}
-	if (arguments.font_size > 0) {
-		fsz = arguments.font_size;
-		printf(_("setting font size=%i\n"), fsz);
-	} else {
-		for (i = 0; i < lines; ++i) {
-			if ((tmp = find_fontsize(print_width/lines, font, line[i])) < 0) {
-				printf(_("could not estimate needed font size\n"));
-				return NULL;
-			}
-			if ((fsz == 0) || (tmp < fsz)) {
-				fsz=tmp;
-			}
-		}
-		printf(_("choosing font size=%i\n"), fsz);
-	}
-	for (i = 0; i < lines; ++i) {
-		tmp = needed_width(line[i], arguments.font_file, fsz);
-		if (tmp > x) {
-			x = tmp;
-		}
-	}
-	im = gdImageCreatePalette(x, print_width);
-	gdImageColorAllocate(im, 255, 255, 255);
-	black = gdImageColorAllocate(im, 0, 0, 0);
-	/* gdImageStringFT(im,brect,fg,fontlist,size,angle,x,y,string) */
-	/* find max needed line height for ALL lines */
-	int max_height=0;
-	for (i = 0; i < lines; ++i) {
-		if ((p = gdImageStringFT(NULL, &brect[0], -black, font, fsz, 0.0, 0, 0, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
-		}
-		//int ofs = get_baselineoffset(line[i], font_file, fsz);
-		int lineheight = brect[1]-brect[5];
-		if (lineheight > max_height) {
-			max_height = lineheight;
-		}
-	}
-	if (arguments.debug) {
-		printf("debug: needed (max) height is %ipx\n", max_height);
-	}
-	if ((max_height * lines) > print_width) {
-		printf("Font size %d too large for %d lines\n", fsz, lines);
-		return NULL;
-	}
-	/* calculate unused pixels */
-	int unused_px = print_width - (max_height * lines);
-	/* now render lines */
-	for (i = 0; i < lines; ++i) {
-		int ofs = get_baselineoffset(line[i], arguments.font_file, fsz);
-		//int pos = ((i)*(print_width/(lines)))+(max_height)-ofs-1;
-		int pos = ((i)*(print_width/(lines)))+(max_height)-ofs;
-		pos += (unused_px/lines) / 2;
-		if (arguments.debug) {
-			printf("debug: line %i pos=%i ofs=%i\n", i+1, pos, ofs);
-		}
-		int off_x = offset_x(line[i], arguments.font_file, fsz);
-		int align_ofs = 0;
-		if (arguments.align == ALIGN_CENTER) {
-			align_ofs = (x - needed_width(line[i], arguments.font_file, fsz)) / 2;
-		} else if (arguments.align == ALIGN_RIGHT) {
-			align_ofs = x - needed_width(line[i], arguments.font_file, fsz);
-		}
-		if ((p = gdImageStringFT(im, &brect[0], -black, font, fsz, 0.0, off_x + align_ofs, pos, line[i])) != NULL) {
-			printf(_("error in gdImageStringFT: %s\n"), p);
-		}
-	}
-	return im;
-}
-
-gdImage *img_append(gdImage *in_1, gdImage *in_2)
-{
-	gdImage *out = NULL;
-	int width = 0;
-	int i_1_x = 0;
-	int length = 0;
-
-	if (in_1 != NULL) {
-		width = gdImageSY(in_1);
-		length = gdImageSX(in_1);
-		i_1_x = gdImageSX(in_1);
-	}
-	if (in_2 != NULL) {
-		length += gdImageSX(in_2);
-		/* width should be the same, but let's be sure */
-		if (gdImageSY(in_2) > width) {
-			width = gdImageSY(in_2);
-		}
-	}
-	if ((width == 0) || (length == 0)) {
-		return NULL;
-	}
-	out = gdImageCreatePalette(length, width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	gdImageColorAllocate(out, 0, 0, 0);
-	if (arguments.debug) {
-		printf("debug: created new img with size %d * %d\n", length, width);
-	}
-	if (in_1 != NULL) {
-		gdImageCopy(out, in_1, 0, 0, 0, 0, gdImageSX(in_1), gdImageSY(in_1));
-		if (arguments.debug) {
-			printf("debug: copied part 1\n");
-		}
-	}
-	if (in_2 != NULL) {
-		gdImageCopy(out, in_2, i_1_x, 0, 0, 0, gdImageSX(in_2), gdImageSY(in_2));
-		if (arguments.debug) {
-			printf("copied part 2\n");
-		}
-	}
-	return out;
-}
-
-gdImage *img_cutmark(int print_width)
-{
-	gdImage *out = NULL;
-	int style_dashed[6];
-
-	out = gdImageCreatePalette(9, print_width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	int black = gdImageColorAllocate(out, 0, 0, 0);
-	style_dashed[0] = gdTransparent;
-	style_dashed[1] = gdTransparent;
-	style_dashed[2] = gdTransparent;
-	style_dashed[3] = black;
-	style_dashed[4] = black;
-	style_dashed[5] = black;
-	gdImageSetStyle(out, style_dashed, 6);
-	gdImageLine(out, 5, 0, 5, print_width - 1, gdStyled);
-	return out;
-}
-
-gdImage *img_padding(int print_width, int length)
-{
-	gdImage *out = NULL;
-
-	if ((length < 1) || (length > 256)) {
-		length=1;
-	}
-	out = gdImageCreatePalette(length, print_width);
-	if (out == NULL) {
-		return NULL;
-	}
-	gdImageColorAllocate(out, 255, 255, 255);
-	return out;
-}
-
-/* Invert image colors: make light pixels dark and vice versa.
-   Operates only within the image bounds so it will not create pixels
-   outside the printable area. */
-void invert_image(gdImage *im)
-{
-	if (!im) return;
-	int sx = gdImageSX(im);
-	int sy = gdImageSY(im);
-	int white = gdImageColorClosest(im, 255, 255, 255);
-	int black = gdImageColorClosest(im, 0, 0, 0);
-	for (int x = 0; x < sx; ++x) {
-		for (int y = 0; y < sy; ++y) {
-			int c = gdImageGetPixel(im, x, y);
-			int r = gdImageRed(im, c);
-			int g = gdImageGreen(im, c);
-			int b = gdImageBlue(im, c);
-			int lum = r + g + b;
-			if (lum > ((255*3)/2)) {
-				/* was light -> make dark */
-				gdImageSetPixel(im, x, y, black);
-			} else {
-				/* was dark -> make light */
-				gdImageSetPixel(im, x, y, white);
-			}
-		}
-	}
-}
-
 void add_job(job_type_t type, int n, char *line)
 {
 	job_t *new_job = (job_t*)malloc(sizeof(job_t));
@@ -559,7 +200,8 @@ void add_job(job_type_t type, int n, char *line)
 	last_added_job = new_job;
 }
 
-void add_text(struct argp_state *state, char *arg, bool new_job)
+/* add a text job, returns -1 if the text has too many lines */
+int add_text(char *arg, bool new_job)
 {
 	char *p = arg;
 	bool first_part = true;
@@ -600,8 +242,7 @@ void add_text(struct argp_state *state, char *arg, bool new_job)
 				add_job(JOB_TEXT, 1, p);
 			} else {
 				if (last_added_job->n >= MAX_LINES) {
-					argp_failure(state, 1, EINVAL, _("Only up to %d lines are supported"), MAX_LINES);
-					return;
+					return -1;
 				}
 				last_added_job->lines[last_added_job->n++] = p;
 			}
@@ -609,6 +250,138 @@ void add_text(struct argp_state *state, char *arg, bool new_job)
 		p = p_next;
 		first_part = false;
 	} while (p);
+	return 0;
+}
+
+void free_job_list(job_t *list)
+{
+	for (job_t *job = list; job != NULL; ) {
+		job_t *next = job->next;
+		free(job);
+		job = next;
+	}
+}
+
+void free_jobs(void)
+{
+	free_job_list(jobs);
+	jobs = last_added_job = NULL;
+}
+
+/* A bulk out transfer may take as long as --timeout, but at least
+   PTOUCH_TX_TIMEOUT, then the printer is taken to be jammed. With
+   --timeout 0 transfers wait forever. */
+static void set_tx_timeout(ptouch_dev ptdev)
+{
+	unsigned int ms = (unsigned int)arguments.timeout * 1000;
+
+	ptdev->tx_timeout = (arguments.timeout <= 0) ? 0 : ((ms > PTOUCH_TX_TIMEOUT) ? ms : PTOUCH_TX_TIMEOUT);
+}
+
+/* open all connected printers which are supported. With --wait and
+   none connected, the printers arriving first are used. */
+static int open_all_printers(ptouch_dev *devs)
+{
+	double deadline = phase_clock() + arguments.wait;
+	bool waiting = false;
+	int ndevs = 0;
+
+	for (;;) {
+		struct _ptouch_found *found;
+		int n = ptouch_enumerate(&found);
+		for (int i = 0; (i < n) && (ndevs < MAX_PRINTERS); ++i) {
+			if (found[i].flags & (FLAG_PLITE|FLAG_UNSUP_RASTER)) {
+				continue;
+			}
+			/* a printer which can't be opened leaves no handle in
+			   devs[ndevs], it is tried again on the next pass */
+			if (ptouch_open_selected(&devs[ndevs], found[i].port) == 0) {
+				++ndevs;
+			}
+		}
+		if (n >= 0) {
+			free(found);
+		}
+		if ((ndevs > 0) || (arguments.wait < 0)) {
+			break;
+		}
+		int left = (int)(deadline - phase_clock() + 0.999);
+		if ((arguments.wait > 0) && (left <= 0)) {
+			break;
+		}
+		if (!waiting) {
+			fprintf(stderr, _("waiting for a P-Touch printer\n"));
+			waiting = true;
+		}
+		if (ptouch_hotplug_wait((arguments.wait > 0) ? left : 0) != 0) {
+			break;
+		}
+	}
+	if (ndevs == 0) {
+		fprintf(stderr, _("No P-Touch printer found on USB (remember to put switch to position E)\n"));
+	}
+	return ndevs;
+}
+
+void list_printers(void)
+{
+	struct _ptouch_found *found;
+	int n = ptouch_enumerate(&found);
+
+	if (n < 0) {
+		return;
+	}
+	if (n == 0) {
+		printf(_("No P-Touch printer found on USB\n"));
+	}
+	for (int i = 0; i < n; ++i) {
+		printf("%d:%d\t%s\t%s\t%s%s\n", found[i].bus, found[i].address, found[i].port,
+			found[i].serial[0] ? found[i].serial : "-", found[i].name,
+			(found[i].flags & (FLAG_PLITE|FLAG_UNSUP_RASTER)) ? _(" (unsupported)") : "");
+	}
+	free(found);
+}
+
+/* --------------------------------------------------------------------
+	Parse the start:end[:step] of --sequence. The step is 1 (or -1 if
+	end is less than start) if it isn't given. If start or end is
+	written with leading zeros, all numbers get as many digits.
+	Returns -1 if spec is invalid.
+   -------------------------------------------------------------------- */
+static int parse_sequence(const char *spec, struct sequence *seq)
+{
+	const char *p = spec;
+	char *end = NULL;
+	long v[3], diff;
+	int n = 0;
+
+	*seq = (struct sequence){ .digits = 0 };
+	while (n < 3) {
+		const char *digits = ((*p == '-') || (*p == '+')) ? p + 1 : p;
+		errno = 0;
+		v[n] = strtol(p, &end, 10);
+		if ((end == p) || (errno != 0)) {
+			return -1;
+		}
+		if ((n < 2) && (*digits == '0') && (end - digits > seq->digits)) {
+			seq->digits = (int)(end - digits);
+		}
+		++n;
+		if (*end != ':') {
+			break;
+		}
+		p = end + 1;
+	}
+	if ((*end != '\0') || (n < 2)) {
+		return -1;
+	}
+	seq->start = v[0];
+	seq->step = (n == 3) ? v[2] : ((v[1] < v[0]) ? -1 : 1);
+	if ((seq->step == 0) || __builtin_sub_overflow(v[1], v[0], &diff) || (diff / seq->step < 0)) {
+		return -1;
+	}
+	seq->count = (unsigned long)(diff / seq->step) + 1;
+	return 0;
 }
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
@@ -625,27 +398,47 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		case 3: // fontsize
 			arguments->font_size = strtol(arg, NULL, 10);
 			break;
+		case 8: // max-length
+			arguments->max_length = strtol(arg, NULL, 10);
+			break;
 		case 30: // invert
 			arguments->invert = true;
 			break;
 		case 4: // writepng
 			arguments->save_png = arg;
 			break;
+		case 16: // write-raw
+			arguments->write_raw = arg;
+			break;
+		case 17: // send-raw
+			arguments->send_raw = arg;
+			break;
 		case 5: // force-tape-width
 			arguments->forced_tape_width = strtol(arg, NULL, 10);
 			break;
 		case 6: // copies
 			arguments->copies = strtol(arg, NULL, 10);
+			if (arguments->copies < 1) {
+				argp_failure(state, 1, EINVAL, _("Invalid number of copies '%s'"), arg);
+			}
 			break;
 		case 7: // timeout
 			arguments->timeout = strtol(arg, NULL, 10);
 			break;
+		case 18: // wait
+			arguments->wait = arg ? strtol(arg, NULL, 10) : 0;
+			if (arguments->wait < 0) {
+				argp_failure(state, 1, EINVAL, _("Invalid time to wait '%s'"), arg);
+			}
+			break;
 		case 'i': // image
 			add_job(JOB_IMAGE, 1, arg);
 			break;
 		case 't': // text
 			//printf("adding text job with alignment %i\n", arguments->align);
-			add_text(state, arg, true);
+			if (add_text(arg, true) != 0) {
+				argp_failure(state, 1, EINVAL, _("Only up to %d lines are supported"), MAX_LINES);
+			}
 			break;
 		case 'c': // cutmark
 			add_job(JOB_CUTMARK, 0, NULL);
@@ -672,7 +465,9 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 			}
 			break;
 		case 'n': // newline
-			add_text(state, arg, false);
+			if (add_text(arg, false) != 0) {
+				argp_failure(state, 1, EINVAL, _("Only up to %d lines are supported"), MAX_LINES);
+			}
 			break;
 		case 20: // info
 			arguments->info = true;
@@ -680,6 +475,56 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 		case 21: // list-supported
 			ptouch_list_supported();
 			exit(0);
+		case 22: // daemon
+			arguments->daemon_socket = arg;
+			break;
+		case 23: // list-printers
+			list_printers();
+			exit(0);
+		case 24: // batch
+			arguments->batch_file = arg;
+			break;
+		case 26: // render-threads
+			arguments->render_threads = strtol(arg, NULL, 10);
+			break;
+		case 27: // sequence
+			if (parse_sequence(arg, &sequence) != 0) {
+				argp_failure(state, 1, EINVAL, _("Invalid sequence '%s'"), arg);
+			}
+			arguments->sequence = arg;
+			break;
+		case 25: // batch-format
+			if (strcmp(arg, "csv") == 0) {
+				arguments->batch_format = BATCH_CSV;
+			} else if (strcmp(arg, "tsv") == 0) {
+				arguments->batch_format = BATCH_TSV;
+			} else if (strcmp(arg, "jobs") == 0) {
+				arguments->batch_format = BATCH_JOBS;
+			} else {
+				argp_failure(state, 1, EINVAL, _("Unknown batch format '%s'"), arg);
+			}
+			break;
+		case 9: // printer
+			arguments->printer = arg;
+			break;
+		case 12: // all-printers
+			arguments->all_printers = true;
+			break;
+		case 13: // virtual
+			arguments->virtual_printer = arg;
+			break;
+		case 14: // stats
+			if (!arg || (strcmp(arg, "text") == 0)) {
+				arguments->stats = STATS_TEXT;
+			} else if (strcmp(arg, "json") == 0) {
+				arguments->stats = STATS_JSON;
+			} else {
+				argp_failure(state, 1, EINVAL, _("Unknown statistics format '%s'"), arg);
+			}
+			break;
+		case 15: // cache-dir
+			arguments->cache_dir = arg;
+			break;
 		case ARGP_KEY_ARG:
 			argp_failure(state, 1, E2BIG, _("No arguments supported"));
 			break;
@@ -691,6 +536,28 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 			if (arguments->forced_tape_width && arguments->info) {
 				argp_failure(state, 1, ENOTSUP, _("Options --force_tape_width and --info can't be used together"));
 			}
+			if (arguments->all_printers && arguments->printer) {
+				argp_failure(state, 1, ENOTSUP, _("Options --printer and --all-printers can't be used together"));
+			}
+			if (arguments->daemon_socket && (arguments->save_png || arguments->info)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --daemon can't be used together with --writepng or --info"));
+			}
+			if (arguments->batch_file && (arguments->save_png || arguments->info || arguments->daemon_socket)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --batch can't be used together with --writepng, --info or --daemon"));
+			}
+			if (arguments->sequence && (arguments->batch_file || arguments->save_png || arguments->info || arguments->daemon_socket)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --sequence can't be used together with --batch, --writepng, --info or --daemon"));
+			}
+			if (arguments->write_raw && (arguments->save_png || arguments->info || arguments->daemon_socket || arguments->all_printers)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --write-raw can't be used together with --writepng, --info, --daemon or --all-printers"));
+			}
+			if (arguments->send_raw && (jobs || arguments->batch_file || arguments->sequence || arguments->write_raw ||
+			    arguments->save_png || arguments->info || arguments->daemon_socket || arguments->all_printers)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --send-raw can't be used together with print commands or other output options"));
+			}
+			if (arguments->batch_file && jobs && (arguments->batch_format == BATCH_JOBS)) {
+				argp_failure(state, 1, ENOTSUP, _("Option --batch-format jobs can't be used together with print commands"));
+			}
 			break;
 		default:
 			return ARGP_ERR_UNKNOWN;
@@ -698,14 +565,1329 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 	return 0;
 }
 
-int main(int argc, char *argv[])
-{
-	int print_width = 0;
-	gdImage *im = NULL;
-	gdImage *out = NULL;
-	ptouch_dev ptdev = NULL;
+struct dispatcher {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* signalled when a label changes its state */
+	batch_label_t *labels;
+	int n;
+};
 
-	setlocale(LC_ALL, "");
+struct print_worker {
+	struct dispatcher *d;
+	ptouch_dev ptdev;
+	pthread_t thread;
+	int printed;
+	int rc;
+};
+
+/* check whether the tape loaded in the printer fits the label */
+static bool label_fits(batch_label_t *l, ptouch_dev ptdev)
+{
+	if (l->media_width && (l->media_width != ptdev->status->media_width)) {
+		return false;
+	}
+	if (l->tape_color && (l->tape_color != ptdev->status->tape_color)) {
+		return false;
+	}
+	return l->bm->width <= (int)ptouch_get_tape_width(ptdev);
+}
+
+/* --------------------------------------------------------------------
+	Take the next pending label which can be printed on ptdev. If there
+	is none and wait is set, wait as long as other printers have labels
+	taken, as they go back to the queue if their printer fails. The
+	caller must not hold a taken label itself when waiting.
+	Returns NULL if there is nothing (left) to print on ptdev.
+   -------------------------------------------------------------------- */
+static batch_label_t *take_label(struct dispatcher *d, ptouch_dev ptdev, bool wait)
+{
+	batch_label_t *l = NULL;
+
+	pthread_mutex_lock(&d->lock);
+	for (;;) {
+		bool taken = false;
+		for (int i = 0; i < d->n; ++i) {
+			if ((d->labels[i].state == LABEL_PENDING) && label_fits(&d->labels[i], ptdev)) {
+				l = &d->labels[i];
+				l->state = LABEL_TAKEN;
+				break;
+			}
+			taken |= (d->labels[i].state == LABEL_TAKEN);
+		}
+		if (l || !wait || !taken) {
+			break;
+		}
+		pthread_cond_wait(&d->cond, &d->lock);
+	}
+	pthread_mutex_unlock(&d->lock);
+	return l;
+}
+
+static void set_label_state(struct dispatcher *d, batch_label_t *l, label_state_t state)
+{
+	pthread_mutex_lock(&d->lock);
+	l->state = state;
+	pthread_cond_broadcast(&d->cond);
+	pthread_mutex_unlock(&d->lock);
+}
+
+/* print labels from the shared queue until there is none left for this
+   printer. If printing fails, the label goes back to the queue and the
+   printer is not used any more, so the others can finish the batch.
+   The raster data is flushed before the print command is sent. When
+   only the print command fails, the printer might have taken it, so
+   the label is given up rather than printed a second time. */
+static void *print_worker(void *arg)
+{
+	struct print_worker *w = arg;
+	batch_label_t *l = take_label(w->d, w->ptdev, true);
+
+	while (l) {
+		if ((print_img(w->ptdev, l->bm, arguments.chain, arguments.precut, arguments.invert) != 0) ||
+		    (ptouch_flush(w->ptdev) != 0)) {
+			set_label_state(w->d, l, LABEL_PENDING);
+			w->rc = -1;
+			break;
+		}
+		/* take the next label first, so the tape is only cut after
+		   the last label printed on this printer */
+		batch_label_t *next = take_label(w->d, w->ptdev, false);
+		if (ptouch_finalize(w->ptdev, arguments.chain || (next != NULL)) != 0) {
+			printf(_("ptouch_finalize(%d) failed, the label might not have been printed\n"), arguments.chain);
+			set_label_state(w->d, l, LABEL_FAILED);
+			if (next) {
+				set_label_state(w->d, next, LABEL_PENDING);
+			}
+			w->rc = -1;
+			break;
+		}
+		set_label_state(w->d, l, LABEL_DONE);
+		w->printed++;
+		l = next ? next : take_label(w->d, w->ptdev, true);
+	}
+	return NULL;
+}
+
+/* --------------------------------------------------------------------
+	Print a batch of labels on several printers at once, one thread
+	per printer. The threads take labels from a shared queue, so faster
+	printers print more labels and a jammed printer does not hold up
+	the others. A label is only printed on a printer with the tape
+	width and color it asks for.
+	Returns 0 if all labels have been printed.
+   -------------------------------------------------------------------- */
+int dispatch_labels(batch_label_t *labels, int n, ptouch_dev *devs, int ndevs)
+{
+	struct dispatcher d = { .labels = labels, .n = n };
+	struct print_worker w[MAX_PRINTERS];
+	int rc = 0;
+
+	if (ndevs > MAX_PRINTERS) {
+		ndevs = MAX_PRINTERS;
+	}
+	pthread_mutex_init(&d.lock, NULL);
+	pthread_cond_init(&d.cond, NULL);
+	for (int i = 0; i < ndevs; ++i) {
+		w[i] = (struct print_worker){ .d = &d, .ptdev = devs[i] };
+		if (pthread_create(&w[i].thread, NULL, print_worker, &w[i]) != 0) {
+			w[i].rc = -1;
+			w[i].ptdev = NULL;
+		}
+	}
+	for (int i = 0; i < ndevs; ++i) {
+		if (w[i].ptdev) {
+			pthread_join(w[i].thread, NULL);
+		}
+		if (arguments.debug) {
+			printf("debug: %s printed %d labels\n", devs[i]->devinfo->name, w[i].printed);
+		}
+	}
+	pthread_cond_destroy(&d.cond);
+	pthread_mutex_destroy(&d.lock);
+	for (int i = 0; i < n; ++i) {
+		if (labels[i].state != LABEL_DONE) {
+			rc = -1;
+		}
+	}
+	if (rc != 0) {
+		printf(_("not all labels could be printed\n"));
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Compose all queued jobs into one label, then print it (or write it
+	to a png file). With more than one printer, the copies are spread
+	over all of them. The job list is emptied.
+	Returns 0 on success, otherwise the exit code for main().
+   -------------------------------------------------------------------- */
+int print_label(ptouch_dev *devs, int ndevs, int print_width)
+{
+	ptouch_dev ptdev = devs ? devs[0] : NULL;
+	ptouch_bitmap out = NULL;
+	char *key = NULL;
+	int rc = 0;
+
+	/* with a single printer, a label which was printed before is
+	   sent from the cache without rendering it again */
+	if (arguments.cache_dir && ptdev && (ndevs == 1) && !arguments.save_png) {
+		char *dev = label_cache_device(ptdev, print_width);
+		uint8_t *raster;
+		size_t raster_len;
+		int columns;
+		key = dev ? label_cache_key(dev, jobs, NULL, arguments.chain, arguments.precut) : NULL;
+		free(dev);
+		if (key && (label_cache_get(arguments.cache_dir, key, &raster, &raster_len, &columns) == 0)) {
+			if (arguments.debug) {
+				printf("debug: label found in cache\n");
+			}
+			free_jobs();
+			free(key);
+			rc = send_copies(ptdev, raster, raster_len, columns);
+			free(raster);
+			return rc;
+		}
+	}
+	if (compose_label(jobs, print_width, &out) != 0) {
+		free_jobs();
+		free(key);
+		return 1;
+	}
+	free_jobs();
+	if (!out) {
+		free(key);
+		return 0;
+	}
+	if (arguments.save_png) {
+		/* when printing, print_img() inverts the rasterlines instead */
+		if (arguments.invert) {
+			ptouch_bitmap_invert(out);
+		}
+		write_png(out, arguments.save_png);
+		ptouch_bitmap_free(out);
+		return 0;
+	}
+	if (ndevs > 1) {
+		/* the label was made for the tape of the first printer */
+		batch_label_t *labels = calloc(arguments.copies, sizeof(batch_label_t));
+		if (!labels) {
+			ptouch_bitmap_free(out);
+			return 2;
+		}
+		for (int i = 0; i < arguments.copies; ++i) {
+			labels[i].bm = out;
+			labels[i].media_width = ptdev->status->media_width;
+			labels[i].tape_color = ptdev->status->tape_color;
+		}
+		if (dispatch_labels(labels, arguments.copies, devs, ndevs) != 0) {
+			rc = 2;
+		} else {
+			printed_columns += (unsigned long)out->length * arguments.copies;
+		}
+		free(labels);
+		ptouch_bitmap_free(out);
+		return rc;
+	}
+	rc = print_copies(ptdev, out, key, NULL, NULL);
+	ptouch_bitmap_free(out);
+	free(key);
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Print arguments.copies copies of bm on ptdev. If key is not NULL,
+	the data sent for the label is stored in the cache under key. If t
+	is not NULL, bm was made by template_compose() with the given
+	part_len.
+	Returns 0 on success, otherwise the exit code for main().
+   -------------------------------------------------------------------- */
+static int print_copies(ptouch_dev ptdev, ptouch_bitmap bm, const char *key, label_template_t *t, const int *part_len)
+{
+	int rc = 0;
+
+	/* with several copies, encode the label only once and
+	   send the recorded data for every copy */
+	bool replay = (arguments.copies > 1) || key;
+	uint8_t *raster = NULL;
+	size_t raster_len = 0;
+	if (replay && (ptouch_record_begin(ptdev) != 0)) {
+		return 2;
+	}
+	if (t) {
+		if (print_template(ptdev, t, bm, part_len, arguments.chain, arguments.precut) != 0) {
+			rc = 2;
+		}
+	} else if (print_img(ptdev, bm, arguments.chain, arguments.precut, arguments.invert) != 0) {
+		rc = 2;
+	}
+	if (replay && (ptouch_record_end(ptdev, &raster, &raster_len) != 0)) {
+		rc = 2;
+	}
+	if ((rc == 0) && key) {
+		label_cache_put(arguments.cache_dir, key, raster, raster_len, bm->length);
+	}
+	if (rc == 0) {
+		rc = send_copies(ptdev, raster, raster_len, bm->length);
+	}
+	free(raster);
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Finish arguments.copies copies of a label of the given number of
+	columns. raster is the recorded data of one copy and is sent
+	before each one, if it is NULL the label was sent already.
+	Returns 0 on success, otherwise the exit code for main().
+   -------------------------------------------------------------------- */
+static int send_copies(ptouch_dev ptdev, uint8_t *raster, size_t raster_len, int columns)
+{
+	for (int i = 0; i < arguments.copies; ++i) {
+		if (raster && (ptouch_send(ptdev, raster, raster_len) != 0)) {
+			printf(_("sending label failed\n"));
+			return 2;
+		}
+		if (ptouch_finalize(ptdev, ( arguments.chain || (i < arguments.copies-1) ) ) != 0) {
+			printf(_("ptouch_finalize(%d) failed\n"), arguments.chain);
+			return 2;
+		}
+		printed_columns += columns;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Find the tape width in mm a --write-raw file was made for, from its
+	print information command. Only the commands which come before the
+	first rasterline are looked at. Models without FLAG_USE_INFO_CMD
+	(like the PT-P700) get no print information, so their files can't
+	be checked against the tape.
+	Returns 0 if the data does not tell.
+   -------------------------------------------------------------------- */
+static int raw_media_width(const uint8_t *d, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		if (d[pos] == 0x00) {		/* invalidate */
+			pos += 1;
+		} else if (d[pos] == 'M') {	/* compression mode */
+			pos += 2;
+		} else if ((d[pos] == 0x1b) && (pos + 1 < len) && (d[pos+1] == '@')) {
+			pos += 2;
+		} else if ((d[pos] == 0x1b) && (pos + 2 < len) && (d[pos+1] == 'i')) {
+			switch (d[pos+2]) {
+				case 'z':	/* print information */
+					return (pos + 5 < len) ? d[pos+5] : 0;
+				case 'S':	/* status request */
+					pos += 3;
+					break;
+				case 'd':	/* margin */
+					pos += 7;
+					break;
+				case 'a':	/* raster mode */
+				case 'R':
+				case 'M':	/* precut */
+				case 'K':	/* chain */
+					pos += 4;
+					break;
+				default:
+					return 0;
+			}
+		} else {
+			return 0;
+		}
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Send a file written with --write-raw to the printer, arguments.copies
+	times. The file is mapped and goes out straight from the mapping,
+	ptouch_send() splits it into transfers of the size of its buffer,
+	each within the transfer timeout. Nothing is rendered or encoded.
+	Returns 0 on success, otherwise the exit code for main().
+   -------------------------------------------------------------------- */
+int send_raw(ptouch_dev ptdev, const char *path)
+{
+	struct stat st;
+	uint8_t *data;
+	int fd = open(path, O_RDONLY), mm, rc = 0;
+
+	if ((fd < 0) || (fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size == 0)) {
+		printf(_("could not read '%s'\n"), path);
+		if (fd >= 0) {
+			close(fd);
+		}
+		return 1;
+	}
+	data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		perror(path);
+		return 1;
+	}
+	madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+	mm = raw_media_width(data, (size_t)st.st_size);
+	if ((mm == 0) && arguments.debug) {
+		printf(_("'%s' does not tell the tape width, not checked\n"), path);
+	}
+	if (mm && (mm != ptdev->status->media_width)) {
+		printf(_("'%s' was made for %d mm tape, but %d mm tape is loaded\n"), path, mm, ptdev->status->media_width);
+		munmap(data, (size_t)st.st_size);
+		return 2;
+	}
+	for (int i = 0; (rc == 0) && (i < arguments.copies); ++i) {
+		if (ptouch_send(ptdev, data, (size_t)st.st_size) != 0) {
+			rc = 2;
+		}
+	}
+	if ((rc == 0) && (ptouch_flush(ptdev) != 0)) {
+		rc = 2;
+	}
+	if (rc != 0) {
+		printf(_("sending '%s' failed\n"), path);
+	}
+	munmap(data, (size_t)st.st_size);
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Print the phase_times and the transfer statistics of all printers
+	to stderr, as text or as one line of JSON. seconds is the wall time
+	the statistics were collected over.
+   -------------------------------------------------------------------- */
+void print_stats(ptouch_dev *devs, int ndevs, double seconds)
+{
+	struct _ptouch_stats st = { 0 };
+	struct phase_times *p = &phase_times;
+
+	for (int i = 0; i < ndevs; ++i) {
+		st.transfers += devs[i]->stats.transfers;
+		st.bytes_out += devs[i]->stats.bytes_out;
+		st.raster_lines += devs[i]->stats.raster_lines;
+		st.raster_raw += devs[i]->stats.raster_raw;
+		st.raster_encoded += devs[i]->stats.raster_encoded;
+		st.tx_seconds += devs[i]->stats.tx_seconds;
+	}
+	double cps = (seconds > 0) ? printed_columns / seconds : 0;
+	if (arguments.stats == STATS_JSON) {
+		fprintf(stderr, "{\"open_ms\":%.3f,\"init_ms\":%.3f,\"status_ms\":%.3f,"
+			"\"render_ms\":%.3f,\"compose_ms\":%.3f,\"raster_ms\":%.3f,\"usb_ms\":%.3f,"
+			"\"total_ms\":%.3f,\"transfers\":%lu,\"bytes_out\":%zu,\"raster_lines\":%zu,"
+			"\"raster_raw\":%zu,\"raster_encoded\":%zu,\"columns\":%lu,\"columns_per_s\":%.1f}\n",
+			p->open*1e3, p->init*1e3, p->status*1e3, p->render*1e3, p->compose*1e3,
+			p->raster*1e3, st.tx_seconds*1e3, seconds*1e3, st.transfers, st.bytes_out,
+			st.raster_lines, st.raster_raw, st.raster_encoded, printed_columns, cps);
+		return;
+	}
+	fprintf(stderr, _("open:      %10.3f ms\n"), p->open*1e3);
+	fprintf(stderr, _("init:      %10.3f ms\n"), p->init*1e3);
+	fprintf(stderr, _("status:    %10.3f ms\n"), p->status*1e3);
+	fprintf(stderr, _("render:    %10.3f ms\n"), p->render*1e3);
+	fprintf(stderr, _("compose:   %10.3f ms\n"), p->compose*1e3);
+	fprintf(stderr, _("raster:    %10.3f ms\n"), p->raster*1e3);
+	fprintf(stderr, _("usb:       %10.3f ms\n"), st.tx_seconds*1e3);
+	fprintf(stderr, _("total:     %10.3f ms\n"), seconds*1e3);
+	fprintf(stderr, _("%lu bulk transfers, %zu bytes sent\n"), st.transfers, st.bytes_out);
+	fprintf(stderr, _("%zu rasterlines, %zu bytes raw, %zu bytes encoded\n"),
+		st.raster_lines, st.raster_raw, st.raster_encoded);
+	fprintf(stderr, _("%lu columns printed, %.1f columns/s\n"), printed_columns, cps);
+}
+
+/* --------------------------------------------------------------------
+	Parse one job sent to the daemon. Every line holds one command,
+	using the names of the command line options:
+	  text <text>, newline <text>, image <file>, pad <n>, cutmark,
+	  chain, precut, copies <n>
+	The strings are used in place, so req must stay valid until the
+	job has been printed.
+   -------------------------------------------------------------------- */
+static int parse_request(char *req)
+{
+	char *line, *save = NULL;
+
+	for (line = strtok_r(req, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save)) {
+		char *arg = strchr(line, ' ');
+		if (arg) {
+			*arg++ = '\0';
+		}
+		if (!strcmp(line, "text") && arg) {
+			if (add_text(arg, true) != 0) {
+				return -1;
+			}
+		} else if (!strcmp(line, "newline") && arg) {
+			if (add_text(arg, false) != 0) {
+				return -1;
+			}
+		} else if (!strcmp(line, "image") && arg) {
+			add_job(JOB_IMAGE, 1, arg);
+		} else if (!strcmp(line, "pad") && arg) {
+			add_job(JOB_PAD, atoi(arg), NULL);
+		} else if (!strcmp(line, "cutmark")) {
+			add_job(JOB_CUTMARK, 0, NULL);
+		} else if (!strcmp(line, "chain")) {
+			arguments.chain = true;
+		} else if (!strcmp(line, "precut")) {
+			arguments.precut = true;
+		} else if (!strcmp(line, "copies") && arg) {
+			arguments.copies = strtol(arg, NULL, 10);
+			if (arguments.copies < 1) {
+				printf(_("invalid number of copies '%s'\n"), arg);
+				return -1;
+			}
+		} else if (line[0] != '\0') {
+			printf(_("unknown command '%s'\n"), line);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* read everything the client sends until it shuts down its side. A
+   client which takes longer than REQUEST_TIMEOUT seconds is dropped, so
+   it can't hold up the jobs waiting behind it. */
+static char *read_request(int fd)
+{
+	size_t len = 0, size = 4096;
+	char *buf = malloc(size);
+	double deadline = phase_clock() + REQUEST_TIMEOUT;
+	ssize_t r;
+
+	while (buf) {
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int left = (int)((deadline - phase_clock()) * 1000);
+		if ((left <= 0) || ((r = poll(&pfd, 1, left)) == 0)) {
+			printf(_("client did not send its job in time, dropped\n"));
+			free(buf);
+			return NULL;
+		}
+		if (r < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(buf);
+			return NULL;
+		}
+		if (len + 1 >= size) {
+			char *p = (size < MAX_REQUEST) ? realloc(buf, size * 2) : NULL;
+			if (!p) {
+				free(buf);
+				return NULL;
+			}
+			buf = p;
+			size *= 2;
+		}
+		if ((r = read(fd, buf + len, size - len - 1)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(buf);
+			return NULL;
+		}
+		if (r == 0) {
+			buf[len] = '\0';
+			break;
+		}
+		len += (size_t)r;
+	}
+	return buf;
+}
+
+static int daemon_print_width(ptouch_dev ptdev)
+{
+	int print_width = ptouch_get_tape_width(ptdev);
+
+	if (print_width > (int)ptouch_get_max_width(ptdev)) {
+		print_width = ptouch_get_max_width(ptdev);
+	}
+	return print_width;
+}
+
+/* --------------------------------------------------------------------
+	Open the printer of the daemon again after it has been unplugged
+	or switched off. Waits until it is back, at most --wait seconds.
+	The old handle in *ptdev is freed, *ptdev is NULL until the
+	printer is back.
+	Returns 0 if the printer is ready again.
+   -------------------------------------------------------------------- */
+static int daemon_reconnect(ptouch_dev *ptdev, int *print_width)
+{
+	ptouch_free(*ptdev);
+	*ptdev = NULL;
+	if (ptouch_open_wait(ptdev, arguments.printer, (arguments.wait > 0) ? arguments.wait : 0) != 0) {
+		return -1;
+	}
+	set_tx_timeout(*ptdev);
+	if ((ptouch_init(*ptdev) != 0) || (ptouch_getstatus(*ptdev, arguments.timeout) != 0)) {
+		printf(_("printer does not answer\n"));
+		ptouch_free(*ptdev);
+		*ptdev = NULL;
+		return -1;
+	}
+	*print_width = daemon_print_width(*ptdev);
+	if (ptouch_watch_begin(*ptdev) != 0) {
+		printf(_("could not watch printer status\n"));
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Daemon mode: keep the printer open and print the jobs received on
+	a unix domain socket, one job per connection. Clients which connect
+	while a job is printing wait in the listen queue. The status read
+	at startup is kept up to date from the messages the printer sends
+	on its own, it is only requested again after a failed job.
+	If the printer has gone away, the next job waits until it is back.
+	The client gets "ok" or "error" back when its job is finished.
+	*devp is the printer, it is replaced when the printer comes back.
+   -------------------------------------------------------------------- */
+int run_daemon(ptouch_dev *devp, int print_width, const char *path)
+{
+	struct sockaddr_un addr;
+	struct arguments defaults = arguments;
+	ptouch_dev ptdev = *devp;
+	bool online = true;
+	int sock;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		printf(_("socket path '%s' is too long\n"), path);
+		return -1;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(sock, 64) != 0)) {
+		perror(path);
+		close(sock);
+		return -1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if (ptouch_watch_begin(ptdev) != 0) {
+		printf(_("could not watch printer status\n"));
+	}
+	printf(_("waiting for jobs on %s\n"), path);
+	for (;;) {
+		int c = accept(sock, NULL, NULL);
+		if (c < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("accept");
+			break;
+		}
+		char *req = read_request(c);
+		int rc = -1;
+		double t0 = phase_clock();
+		if (online && !ptouch_attached(ptdev)) {
+			printf(_("printer disconnected\n"));
+			ptouch_close(ptdev);
+			online = false;
+		}
+		if (!online) {
+			online = (daemon_reconnect(devp, &print_width) == 0);
+			ptdev = *devp;
+		}
+		/* pick up the status messages sent since the last job */
+		while (online && ptdev->watch && (ptouch_watch_poll(ptdev) > 0)) {
+			if (arguments.debug) {
+				printf("debug: status type 0x%02x, phase 0x%02x\n", ptdev->status->status_type, ptdev->status->phase_type);
+			}
+			if (daemon_print_width(ptdev) > 0) {
+				print_width = daemon_print_width(ptdev);
+			}
+		}
+		if (online && req && (parse_request(req) == 0)) {
+			rc = print_label(&ptdev, 1, print_width);
+		}
+		free_jobs();
+		if (online && (rc != 0)) {
+			/* the tape might have been changed, read the status again */
+			ptouch_watch_end(ptdev);
+			if (ptouch_getstatus(ptdev, arguments.timeout) == 0) {
+				print_width = daemon_print_width(ptdev);
+			}
+			ptouch_watch_begin(ptdev);
+		}
+		if (write(c, rc ? "error\n" : "ok\n", rc ? 6 : 3) < 0) {
+			perror("write");
+		}
+		if (arguments.stats && ptdev) {
+			/* the daemon reports every job on its own */
+			print_stats(&ptdev, 1, phase_clock() - t0);
+			memset(&phase_times, 0, sizeof(phase_times));
+			memset(&ptdev->stats, 0, sizeof(ptdev->stats));
+			printed_columns = 0;
+		}
+		free(req);
+		close(c);
+		arguments = defaults;
+	}
+	ptouch_watch_end(ptdev);
+	close(sock);
+	unlink(path);
+	return -1;
+}
+
+/* --------------------------------------------------------------------
+	Read the next record of a batch file into *buf. A csv or tsv record
+	is one line, in csv a quoted field may span several lines. A record
+	in jobs format is a group of lines in the format of parse_request(),
+	terminated by an empty line.
+	Returns the length of the record, or -1 at the end of the file.
+   -------------------------------------------------------------------- */
+static ssize_t read_record(FILE *f, batch_format_t format, char **buf, size_t *size)
+{
+	char *line = NULL;
+	size_t line_size = 0, len = 0;
+	ssize_t n;
+	bool quoted = false;
+
+	while ((n = getline(&line, &line_size, f)) >= 0) {
+		if ((format == BATCH_JOBS) && ((n == 0) || (line[0] == '\n') || (line[0] == '\r'))) {
+			if (len == 0) {
+				continue;	/* skip blank lines between records */
+			}
+			break;
+		}
+		if (len + (size_t)n + 1 > *size) {
+			char *p = realloc(*buf, len + (size_t)n + 1);
+			if (!p) {
+				free(line);
+				return -1;
+			}
+			*buf = p;
+			*size = len + (size_t)n + 1;
+		}
+		memcpy(*buf + len, line, (size_t)n + 1);
+		len += (size_t)n;
+		if (format == BATCH_CSV) {
+			for (ssize_t i = 0; i < n; ++i) {
+				if (line[i] == '"') {
+					quoted = !quoted;
+				}
+			}
+		}
+		if ((format != BATCH_JOBS) && !quoted) {
+			break;
+		}
+	}
+	free(line);
+	if ((n < 0) && (len == 0)) {
+		return -1;
+	}
+	/* strip the line end of the last line */
+	while ((len > 0) && (((*buf)[len-1] == '\n') || ((*buf)[len-1] == '\r'))) {
+		(*buf)[--len] = '\0';
+	}
+	return (ssize_t)len;
+}
+
+/* write number i of the --sequence into *buf as a record, returns -1
+   after the last number */
+static ssize_t sequence_record(unsigned long i, char **buf, size_t *size)
+{
+	long v;
+	int len;
+
+	if (i >= sequence.count) {
+		return -1;
+	}
+	v = sequence.start + (long)i * sequence.step;
+	len = snprintf(NULL, 0, "%0*ld", sequence.digits + (v < 0), v);
+	if ((size_t)len + 1 > *size) {
+		char *p = realloc(*buf, (size_t)len + 1);
+		if (!p) {
+			return -1;
+		}
+		*buf = p;
+		*size = (size_t)len + 1;
+	}
+	snprintf(*buf, *size, "%0*ld", sequence.digits + (v < 0), v);
+	return len;
+}
+
+/* Split a csv or tsv record in place into at most max fields and
+   return their number. In csv, fields may be quoted with '"' and ""
+   stands for a quote inside a quoted field. */
+static int split_record(char *rec, batch_format_t format, char **fields, int max)
+{
+	char sep = (format == BATCH_TSV) ? '\t' : ',';
+	char *in = rec, *out = rec, *field = rec;
+	bool quoted = false;
+	int n = 0;
+
+	for (;;) {
+		char c = *in++;
+		if ((format == BATCH_CSV) && (c == '"')) {
+			if (quoted && (*in == '"')) {
+				*out++ = '"';
+				++in;
+			} else {
+				quoted = !quoted;
+			}
+			continue;
+		}
+		if ((c == '\0') || ((c == sep) && !quoted)) {
+			*out++ = '\0';
+			if (n < max) {
+				fields[n++] = field;
+			}
+			if (c == '\0') {
+				break;
+			}
+			field = out;
+			continue;
+		}
+		*out++ = c;
+	}
+	return n;
+}
+
+/* Split a csv or tsv record in place and add one text job with a line
+   for every non empty field. */
+static int parse_record(char *rec, batch_format_t format)
+{
+	char *fields[MAX_FIELDS];
+	int n = split_record(rec, format, fields, MAX_FIELDS);
+	bool first = true;
+
+	for (int i = 0; i < n; ++i) {
+		if (fields[i][0] != '\0') {
+			if (add_text(fields[i], first) != 0) {
+				return -1;
+			}
+			first = false;
+		}
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Make the job list of one label from the template tmpl: a copy of
+	it with every {n} in its text replaced by field n (counted from 1).
+	Text lines which are empty after that are left out. The new lines
+	are kept in *strings, which is freed together with the jobs.
+	Returns NULL on error.
+   -------------------------------------------------------------------- */
+static job_t *fill_template(job_t *tmpl, char **fields, int nfields, char **strings)
+{
+	job_t *list = NULL, **tail = &list;
+	size_t len = 0;
+	FILE *f = open_memstream(strings, &len);
+	int njobs = 0;
+
+	if (!f) {
+		return NULL;
+	}
+	for (job_t *t = tmpl; t != NULL; t = t->next) {
+		++njobs;
+	}
+	size_t (*pos)[MAX_LINES] = calloc(njobs ? njobs : 1, sizeof(*pos));
+	if (!pos) {
+		fclose(f);
+		free(*strings);
+		*strings = NULL;
+		return NULL;
+	}
+	/* write the lines of the variable jobs, remember where they start */
+	int j = 0;
+	for (job_t *t = tmpl; t != NULL; t = t->next, ++j) {
+		if (!template_job_is_variable(t)) {
+			continue;
+		}
+		for (int i = 0; (i < t->n) && (i < MAX_LINES) && t->lines[i]; ++i) {
+			pos[j][i] = (size_t)ftell(f);
+			for (const char *p = t->lines[i]; *p; ++p) {
+				const char *end;
+				long k = template_field(p, &end);
+				if (k > 0) {
+					if (k <= nfields) {
+						fputs(fields[k-1], f);
+					}
+					p = end;
+				} else {
+					fputc(*p, f);
+				}
+			}
+			fputc('\0', f);
+		}
+	}
+	if (fclose(f) != 0) {
+		free(pos);
+		free(*strings);
+		*strings = NULL;
+		return NULL;
+	}
+	j = 0;
+	for (job_t *t = tmpl; t != NULL; t = t->next, ++j) {
+		job_t *job = malloc(sizeof(job_t));
+		if (!job) {
+			free_job_list(list);
+			list = NULL;
+			break;
+		}
+		*job = *t;
+		job->next = NULL;
+		if (template_job_is_variable(t)) {
+			job->n = 0;
+			for (int i = 0; (i < t->n) && (i < MAX_LINES) && t->lines[i]; ++i) {
+				if ((*strings)[pos[j][i]] != '\0') {
+					job->lines[job->n++] = *strings + pos[j][i];
+				}
+			}
+			for (int i = job->n; i < MAX_LINES; ++i) {
+				job->lines[i] = NULL;
+			}
+		}
+		*tail = job;
+		tail = &job->next;
+	}
+	free(pos);
+	if (!list) {
+		free(*strings);
+		*strings = NULL;
+	}
+	return list;
+}
+
+/* spread the collected labels over all printers, then free them */
+static int dispatch_batch(batch_label_t *labels, int *n, ptouch_dev *devs, int ndevs)
+{
+	int rc = 0;
+
+	if (*n == 0) {
+		return 0;
+	}
+	if (dispatch_labels(labels, *n, devs, ndevs) != 0) {
+		rc = -1;
+	}
+	for (int i = 0; i < *n; ++i) {
+		if (labels[i].state == LABEL_DONE) {
+			printed_columns += labels[i].bm->length;
+		}
+		/* the copies of a label share one bitmap */
+		if ((i == *n - 1) || (labels[i+1].bm != labels[i].bm)) {
+			ptouch_bitmap_free(labels[i].bm);
+		}
+	}
+	*n = 0;
+	return rc;
+}
+
+typedef enum { SLOT_FREE, SLOT_QUEUED, SLOT_BUSY, SLOT_READY } slot_state_t;
+
+/* one label in the reorder buffer of run_batch() */
+typedef struct render_slot {
+	slot_state_t state;
+	unsigned long record;	/* record number in the batch file */
+	unsigned long seq;	/* labels are printed in this order */
+	char *buf;		/* the record, the jobs point into it */
+	job_t *jobs;
+	int copies;
+	bool chain;
+	bool precut;
+	ptouch_bitmap bm;	/* the composed label */
+	int *part_len;		/* length of the template parts on the label */
+	char *strings;		/* the lines filled into a template */
+	char *key;		/* cache key of the label, NULL if not cached */
+	uint8_t *raster;	/* the encoded label, from the cache or encode_slot() */
+	size_t raster_len;
+	int columns;
+	struct _ptouch_stats stats;	/* rasterlines encoded by encode_slot() */
+	int rc;
+} render_slot_t;
+
+struct render_pool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	/* broadcast whenever a slot changes its state */
+	render_slot_t *slots;
+	int nslots;
+	int print_width;
+	ptouch_dev ptdev;	/* printer to encode the labels for, NULL for none */
+	char *device;	/* printer part of the cache keys, NULL without a cache */
+	label_template_t *tmpl;	/* the template of all labels, or NULL */
+	bool stop;
+};
+
+/* encode the label of slot s for the printer of the pool, like
+   print_copies() does, but on a copy of the printer which only records.
+   The worker threads do this while the printer is busy with the labels
+   before. */
+static int encode_slot(struct render_pool *pool, render_slot_t *s)
+{
+	/* only the model and the tape, which don't change while printing */
+	struct _ptouch_dev rec = {
+		.devinfo = pool->ptdev->devinfo,
+		.status = pool->ptdev->status,
+		.tape_width_px = pool->ptdev->tape_width_px,
+	};
+	int rc;
+
+	if (ptouch_record_begin(&rec) != 0) {
+		return -1;
+	}
+	if (s->part_len) {
+		rc = print_template(&rec, pool->tmpl, s->bm, s->part_len, s->chain, s->precut);
+	} else {
+		rc = print_img(&rec, s->bm, s->chain, s->precut, arguments.invert);
+	}
+	if ((ptouch_record_end(&rec, &s->raster, &s->raster_len) != 0) || (rc != 0)) {
+		free(s->raster);
+		s->raster = NULL;
+		return -1;
+	}
+	s->columns = s->bm->length;
+	s->stats = rec.stats;
+	if (s->key) {
+		label_cache_put(arguments.cache_dir, s->key, s->raster, s->raster_len, s->columns);
+	}
+	ptouch_bitmap_free(s->bm);
+	s->bm = NULL;
+	return 0;
+}
+
+/* compose the label of one slot, and encode it if there is a printer */
+static int render_slot(struct render_pool *pool, render_slot_t *s)
+{
+	if (pool->device) {
+		s->key = label_cache_key(pool->device, s->jobs, pool->tmpl, s->chain, s->precut);
+		if (s->key && (label_cache_get(arguments.cache_dir, s->key, &s->raster, &s->raster_len, &s->columns) == 0)) {
+			free_job_list(s->jobs);
+			s->jobs = NULL;
+			return 0;
+		}
+	}
+	int rc;
+	if (pool->tmpl) {
+		/* without a printer to encode for, the static parts are
+		   copied into the label */
+		rc = template_compose(pool->tmpl, s->jobs, pool->print_width, !pool->tmpl->encoded, &s->bm, &s->part_len);
+	} else {
+		rc = compose_label(s->jobs, pool->print_width, &s->bm);
+	}
+
+	free_job_list(s->jobs);
+	s->jobs = NULL;
+	if ((rc != 0) || !s->bm) {
+		return -1;
+	}
+	if (pool->ptdev) {
+		return encode_slot(pool, s);
+	}
+	return 0;
+}
+
+/* render queued slots, the oldest ones first */
+static void *render_worker(void *arg)
+{
+	struct render_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		render_slot_t *s = NULL;
+		for (int i = 0; i < pool->nslots; ++i) {
+			if ((pool->slots[i].state == SLOT_QUEUED) && (!s || (pool->slots[i].seq < s->seq))) {
+				s = &pool->slots[i];
+			}
+		}
+		if (!s) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+		s->state = SLOT_BUSY;
+		pthread_mutex_unlock(&pool->lock);
+		s->rc = render_slot(pool, s);
+		pthread_mutex_lock(&pool->lock);
+		s->state = SLOT_READY;
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	text_cache_free();
+	return NULL;
+}
+
+static void free_slot(render_slot_t *s)
+{
+	free_job_list(s->jobs);
+	ptouch_bitmap_free(s->bm);
+	free(s->part_len);
+	free(s->strings);
+	free(s->key);
+	free(s->raster);
+	free(s->buf);
+	*s = (render_slot_t){ .state = SLOT_FREE };
+}
+
+/* print the label of a rendered slot, or add it to the labels for
+   several printers. Returns 0, 1 if the label was skipped or 2 if
+   printing failed. */
+static int print_slot(render_slot_t *s, label_template_t *t, ptouch_dev *devs, int ndevs, batch_label_t **labels, int *nlabels, int *size)
+{
+	if (s->rc != 0) {
+		return 1;
+	}
+	arguments.copies = s->copies;
+	arguments.chain = s->chain;
+	arguments.precut = s->precut;
+	if (s->raster) {
+		devs[0]->stats.raster_lines += s->stats.raster_lines;
+		devs[0]->stats.raster_raw += s->stats.raster_raw;
+		devs[0]->stats.raster_encoded += s->stats.raster_encoded;
+		return send_copies(devs[0], s->raster, s->raster_len, s->columns);
+	}
+	if (ndevs < 2) {
+		return print_copies(devs[0], s->bm, s->key, s->part_len ? t : NULL, s->part_len);
+	}
+	if (*nlabels + s->copies > *size) {
+		int new_size = *nlabels + s->copies + BATCH_CHUNK;
+		batch_label_t *p = realloc(*labels, new_size * sizeof(batch_label_t));
+		if (!p) {
+			return 2;
+		}
+		*labels = p;
+		*size = new_size;
+	}
+	for (int i = 0; i < s->copies; ++i) {
+		(*labels)[(*nlabels)++] = (batch_label_t){
+			.bm = s->bm,
+			.media_width = devs[0]->status->media_width,
+			.tape_color = devs[0]->status->tape_color,
+		};
+	}
+	s->bm = NULL;	/* freed by dispatch_batch() */
+	if ((*nlabels >= BATCH_CHUNK) && (dispatch_batch(*labels, nlabels, devs, ndevs) != 0)) {
+		return 2;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Prepare the template of a --sequence: its text is drawn from glyphs
+	rendered once, at the font size which fits the first and the last
+	number.
+   -------------------------------------------------------------------- */
+static int sequence_glyphs(label_template_t *t, job_t *tmpl, int print_width)
+{
+	char *buf[2] = { NULL, NULL }, *strings[2] = { NULL, NULL };
+	size_t size[2] = { 0, 0 };
+	job_t *samples[2] = { NULL, NULL };
+	int rc = 0;
+
+	for (int i = 0; (rc == 0) && (i < 2); ++i) {
+		if (sequence_record(i ? sequence.count - 1 : 0, &buf[i], &size[i]) < 0) {
+			rc = -1;
+		} else if ((samples[i] = fill_template(tmpl, &buf[i], 1, &strings[i])) == NULL) {
+			rc = -1;
+		}
+	}
+	if ((rc == 0) && (template_glyphs(t, samples, 2, "-0123456789", print_width) != 0)) {
+		rc = -1;
+	}
+	for (int i = 0; i < 2; ++i) {
+		free_job_list(samples[i]);
+		free(strings[i]);
+		free(buf[i]);
+	}
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Print one label for every record of a batch file, with the
+	printers opened and their status read only once for the whole run.
+	The labels are composed and, with a single printer, encoded by a
+	pool of threads while the previous labels are sent to the printer.
+	A reorder buffer keeps them in the order of the file.
+	A label which can't be composed is skipped, printing stops at the
+	first printer error.
+	If path is NULL, the records are the numbers of the --sequence.
+	Returns 0 on success, otherwise the exit code for main().
+   -------------------------------------------------------------------- */
+int run_batch(ptouch_dev *devs, int ndevs, int print_width, const char *path)
+{
+	FILE *f = !path ? NULL : strcmp(path, "-") ? fopen(path, "r") : stdin;
+	const char *name = path ? path : "sequence";
+	struct arguments defaults = arguments;
+	struct render_pool pool = { .print_width = print_width };
+	pthread_t threads[MAX_RENDER_THREADS];
+	batch_label_t *labels = NULL;
+	int nthreads = arguments.render_threads, nlabels = 0, size = 0, rc = 0;
+	unsigned long record = 0, skipped = 0, queued = 0, printed = 0;
+	bool eof = false;
+
+	if (path && !f) {
+		perror(path);
+		return 1;
+	}
+	if (nthreads < 1) {
+		nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (nthreads < 1) {
+		nthreads = 1;
+	} else if (nthreads > MAX_RENDER_THREADS) {
+		nthreads = MAX_RENDER_THREADS;
+	}
+	pool.nslots = 2 * nthreads;
+	if ((pool.slots = calloc(pool.nslots, sizeof(render_slot_t))) == NULL) {
+		if (f && (f != stdin)) {
+			fclose(f);
+		}
+		return 2;
+	}
+	if (ndevs == 1) {
+		pool.ptdev = devs[0];
+	}
+	if (arguments.cache_dir && (ndevs == 1)) {
+		pool.device = label_cache_device(devs[0], print_width);
+	}
+	/* print commands given with --batch are the template of all labels,
+	   its static parts are prepared once for all of them */
+	if (!path && !jobs) {
+		static char number[] = "{1}";
+		add_text(number, true);
+	}
+	job_t *tmpl_jobs = jobs;
+	jobs = last_added_job = NULL;
+	if (tmpl_jobs && ((pool.tmpl = template_compile(tmpl_jobs, print_width, (ndevs == 1) ? devs[0] : NULL)) == NULL)) {
+		printf(_("could not prepare the label template\n"));
+		rc = 2;
+	} else if (!path && (sequence_glyphs(pool.tmpl, tmpl_jobs, print_width) != 0)) {
+		printf(_("could not prepare the label template\n"));
+		rc = 2;
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.cond, NULL);
+	for (int i = 0; i < nthreads; ++i) {
+		if (pthread_create(&threads[i], NULL, render_worker, &pool) != 0) {
+			nthreads = i;
+			break;
+		}
+	}
+	if (nthreads == 0) {
+		printf(_("could not start render threads\n"));
+		rc = 2;
+	}
+	while (rc == 0) {
+		/* queue records until the reorder buffer is full */
+		while (!eof && (queued - printed < (unsigned long)pool.nslots)) {
+			char *buf = NULL;
+			size_t buf_size = 0;
+			int r;
+			if ((path ? read_record(f, arguments.batch_format, &buf, &buf_size) : sequence_record(record, &buf, &buf_size)) < 0) {
+				free(buf);
+				eof = true;
+				break;
+			}
+			++record;
+			arguments.copies = defaults.copies;
+			arguments.chain = defaults.chain;
+			arguments.precut = defaults.precut;
+			char *strings = NULL;
+			if (path && (arguments.batch_format == BATCH_JOBS)) {
+				r = parse_request(buf);
+			} else if (tmpl_jobs) {
+				char *fields[MAX_FIELDS];
+				int n = split_record(buf, arguments.batch_format, fields, MAX_FIELDS);
+				jobs = fill_template(tmpl_jobs, fields, n, &strings);
+				r = jobs ? 0 : -1;
+			} else {
+				r = parse_record(buf, arguments.batch_format);
+			}
+			if ((r != 0) || !jobs) {
+				if (r != 0) {
+					printf(_("%s: record %lu is invalid, skipped\n"), name, record);
+					++skipped;
+				}
+				free_jobs();
+				free(strings);
+				free(buf);
+				continue;
+			}
+			render_slot_t *s = &pool.slots[queued % pool.nslots];
+			pthread_mutex_lock(&pool.lock);
+			*s = (render_slot_t){
+				.state = SLOT_QUEUED,
+				.record = record,
+				.seq = queued++,
+				.buf = buf,
+				.jobs = jobs,
+				.strings = strings,
+				.copies = arguments.copies,
+				.chain = arguments.chain,
+				.precut = arguments.precut,
+			};
+			pthread_cond_broadcast(&pool.cond);
+			pthread_mutex_unlock(&pool.lock);
+			jobs = last_added_job = NULL;	/* the slot owns them now */
+		}
+		if (printed == queued) {
+			break;
+		}
+		/* print the next label in file order */
+		render_slot_t *s = &pool.slots[printed % pool.nslots];
+		pthread_mutex_lock(&pool.lock);
+		while (s->state != SLOT_READY) {
+			pthread_cond_wait(&pool.cond, &pool.lock);
+		}
+		pthread_mutex_unlock(&pool.lock);
+		int r = print_slot(s, pool.tmpl, devs, ndevs, &labels, &nlabels, &size);
+		if (r == 1) {
+			printf(_("%s: record %lu could not be printed, skipped\n"), name, s->record);
+			++skipped;
+		} else if (r != 0) {
+			rc = r;
+		}
+		pthread_mutex_lock(&pool.lock);
+		free_slot(s);
+		pthread_mutex_unlock(&pool.lock);
+		++printed;
+	}
+	pthread_mutex_lock(&pool.lock);
+	pool.stop = true;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+	for (int i = 0; i < nthreads; ++i) {
+		pthread_join(threads[i], NULL);
+	}
+	for (int i = 0; i < pool.nslots; ++i) {
+		free_slot(&pool.slots[i]);
+	}
+	if ((nlabels > 0) && (dispatch_batch(labels, &nlabels, devs, ndevs) != 0)) {
+		rc = 2;
+	}
+	pthread_cond_destroy(&pool.cond);
+	pthread_mutex_destroy(&pool.lock);
+	arguments = defaults;
+	template_free(pool.tmpl);
+	free_job_list(tmpl_jobs);
+	free(pool.device);
+	free(pool.slots);
+	free(labels);
+	if (f && (f != stdin)) {
+		fclose(f);
+	}
+	if (arguments.debug || skipped) {
+		printf(_("%lu records read, %lu skipped\n"), record, skipped);
+	}
+	if ((rc == 0) && skipped) {
+		rc = 1;
+	}
+	return rc;
+}
+
+int main(int argc, char *argv[])
+{
+	int print_width = 0;
+	ptouch_dev printers[MAX_PRINTERS];
+	int nprinters = 0;
+	ptouch_dev ptdev = NULL;
+	double start = phase_clock(), t0;
+
+	setlocale(LC_ALL, "");
 	const char *textdomain_dir = getenv("TEXTDOMAINDIR");
 	if (!textdomain_dir) {
 		textdomain_dir = "/usr/share/locale/";
@@ -722,14 +1904,40 @@ int main(int argc, char *argv[])
 			print_width = 76;	/* default to 12mm tape */
 		}
 	} else {
-		if ((ptouch_open(&ptdev)) < 0) {
+		t0 = phase_clock();
+		if (arguments.virtual_printer) {
+			if (ptouch_open_virtual(&printers[0], arguments.virtual_printer) == 0) {
+				nprinters = 1;
+			}
+		} else if (arguments.all_printers) {
+			nprinters = open_all_printers(printers);
+		} else if (arguments.wait >= 0) {
+			if (ptouch_open_wait(&printers[0], arguments.printer, arguments.wait) == 0) {
+				nprinters = 1;
+			}
+		} else if ((ptouch_open_selected(&printers[0], arguments.printer)) == 0) {
+			nprinters = 1;
+		}
+		if (nprinters < 1) {
 			return 5;
 		}
-		if (ptouch_init(ptdev) != 0) {
-			printf(_("ptouch_init() failed\n"));
+		phase_times.open = phase_clock() - t0;
+		ptdev = printers[0];
+		for (int i = 0; i < nprinters; ++i) {
+			set_tx_timeout(printers[i]);
+			t0 = phase_clock();
+			if (ptouch_init(printers[i]) != 0) {
+				printf(_("ptouch_init() failed\n"));
+			}
+			phase_times.init += phase_clock() - t0;
+			t0 = phase_clock();
+			if (ptouch_getstatus(printers[i], arguments.timeout) != 0) {
+				printf(_("ptouch_getstatus() failed\n"));
+				return 1;
+			}
+			phase_times.status += phase_clock() - t0;
 		}
-		if (ptouch_getstatus(ptdev, arguments.timeout) != 0) {
-			printf(_("ptouch_getstatus() failed\n"));
+		if (arguments.write_raw && (ptouch_redirect(ptdev, arguments.write_raw) != 0)) {
 			return 1;
 		}
 		print_width = ptouch_get_tape_width(ptdev);
@@ -754,86 +1962,30 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	// iterate through all print jobs
-	for (job_t *job = jobs; job != NULL; job = job->next) {
-		if (arguments.debug) {
-			printf("job %p: type=%d | n=%d", job, job->type, job->n);
-			for (int i=0; i<MAX_LINES; ++i) {
-				printf(" | %s", job->lines[i]);
-			}
-			printf(" | next=%p\n", job->next);
+	if (arguments.send_raw) {
+		int rc = send_raw(ptdev, arguments.send_raw);
+		if (arguments.stats) {
+			print_stats(printers, nprinters, phase_clock() - start);
 		}
-
-		switch (job->type) {
-			case JOB_IMAGE:
-				if ((im = image_load(job->lines[0])) == NULL) {
-					printf(_("failed to load image file\n"));
-					return 1;
-				}
-				out = img_append(out, im);
-				gdImageDestroy(im);
-				im = NULL;
-				break;
-			case JOB_TEXT:
-				if ((im = render_text(arguments.font_file, job->lines, job->n, print_width)) == NULL) {
-					printf(_("could not render text\n"));
-					return 1;
-				}
-				out = img_append(out, im);
-				gdImageDestroy(im);
-				im = NULL;
-				break;
-			case JOB_CUTMARK:
-				im = img_cutmark(print_width);
-				out = img_append(out, im);
-				gdImageDestroy(im);
-				im = NULL;
-				break;
-			case JOB_PAD:
-				im = img_padding(print_width, job->n);
-				out = img_append(out, im);
-				gdImageDestroy(im);
-				im = NULL;
-				break;
-			default:
-				break;
+		if (rc != 0) {
+			return rc;
 		}
 	}
-
-	// clean up job list
-	for (job_t *job = jobs; job != NULL; ) {
-		job_t *next = job->next;
-		free(job);
-		job = next;
-	}
-	jobs = last_added_job = NULL;
-
-	if (out) {
-		/* If requested, invert the whole output (white text on black background).
-		   This operates only within the image bounds (which are already capped
-		   to the printer's printable area), so it won't exceed the printable area. */
-		if (arguments.invert) {
-			invert_image(out);
+	if (jobs || arguments.batch_file || arguments.sequence) {
+		int rc = (arguments.batch_file || arguments.sequence) ? run_batch(printers, nprinters, print_width, arguments.batch_file) : print_label(printers, nprinters, print_width);
+		if (arguments.stats) {
+			print_stats(printers, nprinters, phase_clock() - start);
 		}
-		if (arguments.save_png) {
-			write_png(out, arguments.save_png);
-		} else {
-			for (int i = 0; i < arguments.copies; ++i) {
-				print_img(ptdev, out, arguments.chain, arguments.precut);
-				if (ptouch_finalize(ptdev, ( arguments.chain || (i < arguments.copies-1) ) ) != 0) {
-					printf(_("ptouch_finalize(%d) failed\n"), arguments.chain);
-					return 2;
-				}
-			}
+		if (rc != 0) {
+			return rc;
 		}
-		gdImageDestroy(out);
 	}
-	if (im != NULL) {
-		gdImageDestroy(im);
+	if (arguments.daemon_socket) {
+		run_daemon(&printers[0], print_width, arguments.daemon_socket);
 	}
-	if (!arguments.forced_tape_width) {
-		ptouch_close(ptdev);
+	for (int i = 0; i < nprinters; ++i) {
+		ptouch_free(printers[i]);
 	}
-	libusb_exit(NULL);
+	ptouch_exit();
 	return 0;
 }
@@ -0,0 +1,995 @@
+/*
+	ptouch-render - render, compose and rasterize labels for ptouch-print
+
+	Copyright (C) 2015-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc() */
+#include <stdbool.h>
+#include <string.h>	/* strcmp() */
+#include <time.h>	/* clock_gettime() */
+#include <pthread.h>
+#include <gd.h>
+#include <libintl.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+#define _(s) gettext(s)
+
+struct text_metrics {
+	char *font;
+	char *text;
+	int fsz;
+	int brect[8];
+};
+/* every thread rendering text has its own cache */
+static _Thread_local struct text_metrics metrics_cache[METRICS_CACHE_SIZE];
+static _Thread_local double thread_render;	/* render time of this thread */
+
+struct phase_times phase_times;
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* monotonic time in seconds */
+double phase_clock(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)t.tv_sec + (double)t.tv_nsec/1e9;
+}
+
+/* add seconds to one of the phase_times, labels may be printed by
+   several threads at once */
+void phase_add(double *phase, double seconds)
+{
+	pthread_mutex_lock(&phase_lock);
+	*phase += seconds;
+	pthread_mutex_unlock(&phase_lock);
+}
+
+/* --------------------------------------------------------------------
+   -------------------------------------------------------------------- */
+
+/* --------------------------------------------------------------------
+	Rasterize the columns x0 .. x0+ncols-1 of im into ncols rasterlines
+	of bpl bytes each, in the layout of ptouch_bitmap and the printer
+	(pixel 0 is the lowest bit of the last byte). Pixels with color 'dark' are printed,
+	the image is placed 'offset' pixels from the bottom.
+	The pixel rows are read directly in row order, so one tile of
+	rasterlines stays in the cache while the image is walked through.
+	lines must be zeroed by the caller.
+   -------------------------------------------------------------------- */
+void rasterize_tile(gdImage *im, int dark, int offset, int x0, int ncols, uint8_t *lines, size_t bpl)
+{
+	int sy = gdImageSY(im);
+
+	for (int y = 0; y < sy; ++y) {
+		int px = offset + sy - 1 - y;
+		if ((px < 0) || (px >= (int)(bpl*8))) {
+			continue;
+		}
+		uint8_t *dst = lines + (bpl-1) - (px/8);
+		uint8_t bit = (uint8_t)(1 << (px%8));
+		int c = 0;
+		if (gdImageTrueColor(im)) {
+			const int *row = im->tpixels[y] + x0;
+			for (; c < ncols; ++c) {
+				if (row[c] == dark) {
+					dst[c*bpl] |= bit;
+				}
+			}
+			continue;
+		}
+		const uint8_t *row = im->pixels[y] + x0;
+#if defined(__AVX2__)
+		const __m256i d32 = _mm256_set1_epi8((char)dark);
+		for (; c + 32 <= ncols; c += 32) {
+			uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(row + c)), d32));
+			while (m) {
+				dst[(c + __builtin_ctz(m))*bpl] |= bit;
+				m &= m - 1;
+			}
+		}
+#endif
+#if defined(__SSE2__)
+		const __m128i d16 = _mm_set1_epi8((char)dark);
+		for (; c + 16 <= ncols; c += 16) {
+			uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(row + c)), d16));
+			while (m) {
+				dst[(c + __builtin_ctz(m))*bpl] |= bit;
+				m &= m - 1;
+			}
+		}
+#endif
+		for (; c < ncols; ++c) {
+			if (row[c] == dark) {
+				dst[c*bpl] |= bit;
+			}
+		}
+	}
+}
+
+/* find out whether color 0 or color 1 is darker */
+static int dark_color(gdImage *im)
+{
+	return (gdImageRed(im,1) + gdImageGreen(im,1) + gdImageBlue(im,1) < gdImageRed(im,0) + gdImageGreen(im,0) + gdImageBlue(im,0))?1:0;
+}
+
+/* --------------------------------------------------------------------
+	Convert im into a bitmap. Pixels with the darker one of color 0
+	and 1 are set.
+   -------------------------------------------------------------------- */
+ptouch_bitmap image_to_bitmap(gdImage *im)
+{
+	ptouch_bitmap bm;
+
+	if (!im || ((bm = ptouch_bitmap_new(gdImageSX(im), gdImageSY(im))) == NULL)) {
+		return NULL;
+	}
+	int d = dark_color(im);
+	for (int k = 0; k < bm->length; k += RASTER_TILE) {
+		int n = bm->length - k;
+		if (n > RASTER_TILE) {
+			n = RASTER_TILE;
+		}
+		rasterize_tile(im, d, 0, k, n, ptouch_bitmap_column(bm, k), bm->bpl);
+	}
+	return bm;
+}
+
+/* convert a bitmap into a black and white palette image */
+gdImage *bitmap_to_image(ptouch_bitmap bm)
+{
+	gdImage *im = gdImageCreatePalette(bm->length, bm->width);
+
+	if (!im) {
+		return NULL;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	int black = gdImageColorAllocate(im, 0, 0, 0);
+	for (int y = 0; y < bm->width; ++y) {
+		for (int x = 0; x < bm->length; ++x) {
+			if (ptouch_bitmap_get(bm, x, y)) {
+				gdImageSetPixel(im, x, y, black);
+			}
+		}
+	}
+	return im;
+}
+
+/* --------------------------------------------------------------------
+	Send everything that goes before the rasterlines of a label with
+	the given length and width in pixels.
+	Returns the offset of the label on the print head, -1 on error.
+   -------------------------------------------------------------------- */
+int print_begin(ptouch_dev ptdev, int length, int width, int chain, int precut)
+{
+	int tape_width = ptouch_get_tape_width(ptdev);
+	size_t max_pixels = ptouch_get_max_width(ptdev);
+	if (width > tape_width) {
+		printf(_("image is too large (%ipx x %ipx)\n"), length, width);
+		printf(_("maximum printing width for this tape is %ipx\n"), tape_width);
+		return -1;
+	}
+	printf(_("image size (%ipx x %ipx)\n"), length, width);
+	int offset = ((int)max_pixels / 2) - (width/2);	/* always print centered */
+	printf("max_pixels=%ld, offset=%d\n", max_pixels, offset);
+	/* let the rasterlines go out while the next ones are being encoded,
+	   unless they are only recorded */
+	if (!ptdev->recbuf && (ptouch_async_begin(ptdev, PTOUCH_ASYNC_XFERS) != 0) && arguments.debug) {
+		printf(_("async USB transfers not available, falling back to sync mode\n"));
+	}
+	if ((ptdev->devinfo->flags & FLAG_RASTER_PACKBITS) == FLAG_RASTER_PACKBITS) {
+		if (arguments.debug) {
+			printf("enable PackBits mode\n");
+		}
+		ptouch_enable_packbits(ptdev);
+	}
+	if (ptouch_rasterstart(ptdev) != 0) {
+		printf(_("ptouch_rasterstart() failed\n"));
+		ptouch_async_end(ptdev);
+		return -1;
+	}
+	if ((ptdev->devinfo->flags & FLAG_USE_INFO_CMD) == FLAG_USE_INFO_CMD) {
+		ptouch_info_cmd(ptdev, length);
+		if (arguments.debug) {
+			printf(_("send print information command\n"));
+		}
+	}
+	if ((ptdev->devinfo->flags & FLAG_D460BT_MAGIC) == FLAG_D460BT_MAGIC) {
+		ptouch_send_d460bt_magic(ptdev);
+		if (arguments.debug) {
+			printf(_("send PT-D460BT magic commands\n"));
+		}
+	}
+	if ((ptdev->devinfo->flags & FLAG_HAS_PRECUT) == FLAG_HAS_PRECUT) {
+		if (precut) {
+			ptouch_send_precut_cmd(ptdev, 1);
+			if (arguments.debug) {
+				printf(_("send precut command\n"));
+			}
+		}
+	}
+	/* send chain command after precut, to allow precutting before chain */
+	if ((ptdev->devinfo->flags & FLAG_D460BT_MAGIC) == FLAG_D460BT_MAGIC) {
+		if (chain) {
+			ptouch_send_d460bt_chain(ptdev);
+			if (arguments.debug) {
+				printf(_("send PT-D460BT chain commands\n"));
+			}
+		}
+	}
+	return offset;
+}
+
+/* --------------------------------------------------------------------
+	Send the columns x .. x+n-1 of bm as rasterlines, with the bottom
+	row offset pixels from the bottom of the print head.
+   -------------------------------------------------------------------- */
+int print_columns(ptouch_dev ptdev, ptouch_bitmap bm, int x, int n, int offset, int invert)
+{
+	size_t bpl = (ptdev->devinfo->max_px)/8;
+	uint8_t line[bpl], blank[bpl];
+
+	/* inverting is a XOR with the printable window of the tape,
+	   every rasterline starts out from that mask */
+	if (invert) {
+		ptouch_bitmap_window(blank, bpl, offset, bm->width);
+	} else {
+		memset(blank, 0, bpl);
+	}
+	for (int end = x + n; x < end; ++x) {
+		memcpy(line, blank, bpl);
+		ptouch_bitmap_line(bm, x, line, bpl, offset);
+		if (ptouch_sendraster(ptdev, line, bpl) != 0) {
+			printf(_("ptouch_sendraster() failed\n"));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* wait until all rasterlines of a label are sent */
+int print_end(ptouch_dev ptdev)
+{
+	if (ptouch_async_end(ptdev) != 0) {
+		printf(_("sending raster data failed\n"));
+		return -1;
+	}
+	return 0;
+}
+
+int print_img(ptouch_dev ptdev, ptouch_bitmap bm, int chain, int precut, int invert)
+{
+	double t0 = phase_clock(), usb0 = ptdev->stats.tx_seconds;
+	int offset, rc;
+
+	if (!bm) {
+		printf(_("nothing to print\n"));
+		return -1;
+	}
+	if ((offset = print_begin(ptdev, bm->length, bm->width, chain, precut)) < 0) {
+		return -1;
+	}
+	if (print_columns(ptdev, bm, 0, bm->length, offset, invert) != 0) {
+		ptouch_async_end(ptdev);
+		return -1;
+	}
+	rc = print_end(ptdev);
+	phase_add(&phase_times.raster, phase_clock() - t0 - (ptdev->stats.tx_seconds - usb0));
+	return rc;
+}
+
+int write_png(ptouch_bitmap bm, const char *file)
+{
+	FILE *f;
+	gdImage *im = bitmap_to_image(bm);
+
+	if (!im || ((f = fopen(file, "wb")) == NULL)) {
+		printf(_("writing image '%s' failed\n"), file);
+		if (im) {
+			gdImageDestroy(im);
+		}
+		return -1;
+	}
+	gdImagePng(im, f);
+	fclose(f);
+	gdImageDestroy(im);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Get the bounding box of text in font and size fsz, the same way as
+	gdImageStringFT(NULL, brect, ...) does. Fitting and placing text
+	measures the same strings many times, so the results are kept in a
+	small hash table keyed on (font, size, text).
+	Returns NULL on success or the error message of gd.
+   -------------------------------------------------------------------- */
+char *text_bbox(char *font, int fsz, char *text, int brect[8])
+{
+	uint32_t h = 2166136261u;	/* FNV-1a */
+	char *p;
+
+	for (p = font; *p; ++p) {
+		h = (h ^ (uint8_t)*p) * 16777619u;
+	}
+	h = (h ^ (uint32_t)fsz) * 16777619u;
+	for (p = text; *p; ++p) {
+		h = (h ^ (uint8_t)*p) * 16777619u;
+	}
+	struct text_metrics *m = &metrics_cache[h % METRICS_CACHE_SIZE];
+	if (m->font && (m->fsz == fsz) && !strcmp(m->font, font) && !strcmp(m->text, text)) {
+		memcpy(brect, m->brect, sizeof(m->brect));
+		return NULL;
+	}
+	if ((p = gdImageStringFT(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, text)) != NULL) {
+		memset(brect, 0, 8*sizeof(int));
+		return p;
+	}
+	free(m->font);
+	free(m->text);
+	m->font = strdup(font);
+	m->text = strdup(text);
+	if (!m->font || !m->text) {
+		free(m->font);
+		free(m->text);
+		m->font = m->text = NULL;
+		return NULL;
+	}
+	m->fsz = fsz;
+	memcpy(m->brect, brect, sizeof(m->brect));
+	return NULL;
+}
+
+/* free the text metrics cached by the calling thread */
+void text_cache_free(void)
+{
+	for (int i = 0; i < METRICS_CACHE_SIZE; ++i) {
+		free(metrics_cache[i].font);
+		free(metrics_cache[i].text);
+		metrics_cache[i].font = metrics_cache[i].text = NULL;
+	}
+}
+
+/* --------------------------------------------------------------------
+	Find out the difference in pixels between a "normal" char and one
+	that goes below the font baseline
+   -------------------------------------------------------------------- */
+int get_baselineoffset(char *text, char *font, int fsz)
+{
+	int brect[8];
+
+	/* NOTE: This assumes that 'o' is always on the baseline */
+	text_bbox(font, fsz, "o", brect);
+	int o_offset = brect[1];
+	text_bbox(font, fsz, text, brect);
+	int text_offset = brect[1];
+	if (arguments.debug) {
+		printf(_("debug: o baseline offset - %d\n"), o_offset);
+		printf(_("debug: text baseline offset - %d\n"), text_offset);
+	}
+	return text_offset-o_offset;
+}
+
+/* check whether text in font size fsz is at most want_px high and
+   (if max_len is not 0) at most max_len pixels long */
+static bool fontsize_fits(int fsz, int want_px, int max_len, char *font, char *text)
+{
+	int brect[8];
+
+	if (text_bbox(font, fsz, text, brect) != NULL) {
+		return false;
+	}
+	if (brect[1]-brect[5] > want_px) {
+		return false;
+	}
+	if ((max_len > 0) && (brect[2]-brect[0] > max_len)) {
+		return false;
+	}
+	return true;
+}
+
+/* --------------------------------------------------------------------
+	Find out which fontsize we need for a given font to get a
+	specified pixel size (and optionally a maximum text length)
+	The text height grows about linearly with the font size, so the
+	size is first extrapolated from a measurement at the smallest size,
+	then the exact size is found by a binary search around it.
+	NOTE: This does NOT work for some UTF-8 chars like µ
+   -------------------------------------------------------------------- */
+int find_fontsize(int want_px, int max_len, char *font, char *text)
+{
+	const int min_size = 4, max_size = 4096;
+	int brect[8];
+	int lo, hi, h;
+
+	if (!fontsize_fits(min_size, want_px, max_len, font, text)) {
+		return -1;
+	}
+	text_bbox(font, min_size, text, brect);
+	h = brect[1]-brect[5];
+	/* lo always fits, hi never fits */
+	lo = min_size;
+	hi = (h > 0) ? (min_size * want_px / h) : min_size * 2;
+	if (hi <= lo) {
+		hi = lo + 1;
+	}
+	while (fontsize_fits(hi, want_px, max_len, font, text)) {
+		lo = hi;
+		if (hi >= max_size) {
+			return max_size;
+		}
+		hi += (hi - min_size) / 4 + 1;
+		if (hi > max_size) {
+			hi = max_size;
+		}
+	}
+	while (hi - lo > 1) {
+		int mid = lo + (hi - lo) / 2;
+		if (fontsize_fits(mid, want_px, max_len, font, text)) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+	if (arguments.debug) {
+		printf("debug: font size %i fits into %ipx\n", lo, want_px);
+	}
+	return lo;
+}
+
+int needed_width(char *text, char *font, int fsz)
+{
+	int brect[8];
+
+	if (text_bbox(font, fsz, text, brect) != NULL) {
+		return -1;
+	}
+	return brect[2]-brect[0];
+}
+
+int offset_x(char *text, char *font, int fsz)
+{
+	int brect[8];
+
+	if (text_bbox(font, fsz, text, brect) != NULL) {
+		return -1;
+	}
+	return -brect[0];
+}
+
+static pthread_once_t font_setup_once = PTHREAD_ONCE_INIT;
+static bool font_config;
+
+/* set up gd's font handling once, before text is rendered by several
+   threads at once */
+static void font_setup(void)
+{
+	font_config = (gdFTUseFontConfig(1) == GD_TRUE);
+	gdFontCacheSetup();
+}
+
+/* the largest font size at which all lines fit on the tape (and into
+   --max-length), or -1 */
+int fit_fontsize(char *font, char *line[], int lines, int print_width)
+{
+	int fsz = 0;
+
+	pthread_once(&font_setup_once, font_setup);
+	for (int i = 0; i < lines; ++i) {
+		int tmp = find_fontsize(print_width/lines, arguments.max_length, font, line[i]);
+		if (tmp < 0) {
+			printf(_("could not estimate needed font size\n"));
+			return -1;
+		}
+		if ((fsz == 0) || (tmp < fsz)) {
+			fsz = tmp;
+		}
+	}
+	return fsz;
+}
+
+static gdImage *render_lines(char *font, char *line[], int lines, int print_width)
+{
+	int brect[8];
+	int i, black, x = 0, tmp = 0, fsz = 0;
+	char *p;
+	gdImage *im = NULL;
+
+	if (arguments.debug) {
+		printf(_("render_text(): %i lines, font = '%s', align = '%c'\n"), lines, font, arguments.align);
+	}
+	pthread_once(&font_setup_once, font_setup);
+	if (!font_config) {
+		printf(_("warning: font config not available\n"));
+	}
+	if (arguments.font_size > 0) {
+		fsz = arguments.font_size;
+		printf(_("setting font size=%i\n"), fsz);
+	} else {
+		if ((fsz = fit_fontsize(font, line, lines, print_width)) < 0) {
+			return NULL;
+		}
+		printf(_("choosing font size=%i\n"), fsz);
+	}
+	for (i = 0; i < lines; ++i) {
+		tmp = needed_width(line[i], arguments.font_file, fsz);
+		if (tmp > x) {
+			x = tmp;
+		}
+	}
+	im = gdImageCreatePalette(x, print_width);
+	gdImageColorAllocate(im, 255, 255, 255);
+	black = gdImageColorAllocate(im, 0, 0, 0);
+	/* gdImageStringFT(im,brect,fg,fontlist,size,angle,x,y,string) */
+	/* find max needed line height for ALL lines */
+	int max_height=0;
+	for (i = 0; i < lines; ++i) {
+		if ((p = text_bbox(font, fsz, line[i], brect)) != NULL) {
+			printf(_("error in gdImageStringFT: %s\n"), p);
+		}
+		//int ofs = get_baselineoffset(line[i], font_file, fsz);
+		int lineheight = brect[1]-brect[5];
+		if (lineheight > max_height) {
+			max_height = lineheight;
+		}
+	}
+	if (arguments.debug) {
+		printf("debug: needed (max) height is %ipx\n", max_height);
+	}
+	if ((max_height * lines) > print_width) {
+		printf("Font size %d too large for %d lines\n", fsz, lines);
+		return NULL;
+	}
+	/* calculate unused pixels */
+	int unused_px = print_width - (max_height * lines);
+	/* now render lines */
+	for (i = 0; i < lines; ++i) {
+		int ofs = get_baselineoffset(line[i], arguments.font_file, fsz);
+		//int pos = ((i)*(print_width/(lines)))+(max_height)-ofs-1;
+		int pos = ((i)*(print_width/(lines)))+(max_height)-ofs;
+		pos += (unused_px/lines) / 2;
+		if (arguments.debug) {
+			printf("debug: line %i pos=%i ofs=%i\n", i+1, pos, ofs);
+		}
+		int off_x = offset_x(line[i], arguments.font_file, fsz);
+		int align_ofs = 0;
+		if (arguments.align == ALIGN_CENTER) {
+			align_ofs = (x - needed_width(line[i], arguments.font_file, fsz)) / 2;
+		} else if (arguments.align == ALIGN_RIGHT) {
+			align_ofs = x - needed_width(line[i], arguments.font_file, fsz);
+		}
+		if ((p = gdImageStringFT(im, &brect[0], -black, font, fsz, 0.0, off_x + align_ofs, pos, line[i])) != NULL) {
+			printf(_("error in gdImageStringFT: %s\n"), p);
+		}
+	}
+	return im;
+}
+
+gdImage *render_text(char *font, char *line[], int lines, int print_width)
+{
+	double t0 = phase_clock();
+	gdImage *im = render_lines(font, line, lines, print_width);
+
+	t0 = phase_clock() - t0;
+	thread_render += t0;
+	phase_add(&phase_times.render, t0);
+	return im;
+}
+
+/* the pixel column of a pen position */
+static int glyph_x(int pen)
+{
+	return (pen >= 0) ? pen / GLYPH_UNIT : -((GLYPH_UNIT - 1 - pen) / GLYPH_UNIT);
+}
+
+/* the fraction of a pixel a pen position is at */
+static int glyph_frac(int pen)
+{
+	return pen - glyph_x(pen) * GLYPH_UNIT;
+}
+
+/* where the box of g ends with the pen at pen, in pixels from
+   glyph_x(pen). Returns -1 if that wasn't measured. */
+static int glyph_right(const glyph_t *g, int pen, int *right)
+{
+	for (int i = 0; i < g->pens; ++i) {
+		if (g->pen[i] == glyph_frac(pen)) {
+			*right = g->right[i];
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* pre-render character c */
+static int glyph_render(glyph_t *g, char *font, int fsz, char c)
+{
+	char s[3] = { ' ', c, '\0' };
+	gdFTStringExtra ex = { .flags = gdFTEX_XSHOW };
+	int brect[8], black;
+	const int m = 2;	/* margin around the bounding box */
+
+	/* gd places characters at fractional advances, xshow tells them.
+	   It has the advance of the last character only if there are
+	   two, the one of the first includes kerning. */
+	if (gdImageStringFTEx(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, s, &ex) != NULL) {
+		return 0;	/* not cached, the text is rendered by gd */
+	}
+	char *adv = ex.xshow ? strchr(ex.xshow, ' ') : NULL;
+	g->advance = adv ? (int)(strtod(adv, NULL) * GLYPH_UNIT + 0.5) : 0;
+	gdFree(ex.xshow);
+	if (text_bbox(font, fsz, s + 1, brect) != NULL) {
+		return 0;
+	}
+	g->box[0] = brect[0];
+	g->box[1] = brect[5];
+	g->box[2] = brect[2];
+	g->box[3] = brect[1];
+	g->left = g->box[0] - m;
+	g->top = g->box[1] - m;
+	gdImage *im = gdImageCreatePalette(g->box[2] - g->box[0] + 2*m, g->box[3] - g->box[1] + 2*m);
+	if (!im) {
+		return -1;
+	}
+	gdImageColorAllocate(im, 255, 255, 255);
+	black = gdImageColorAllocate(im, 0, 0, 0);
+	gdImageStringFT(im, &brect[0], -black, font, fsz, 0.0, -g->left, -g->top, s + 1);
+	g->bm = image_to_bitmap(im);
+	gdImageDestroy(im);
+	return g->bm ? 0 : -1;
+}
+
+/* --------------------------------------------------------------------
+	gd rounds the bounding box of the whole text, so the column where
+	it ends after a character depends on the fraction of a pixel the
+	pen is at. Find texts which put the pen at every fraction the
+	cached characters can reach (up to GLYPH_PENS of them), and note
+	where the box ends with each character put after them, wherever
+	that character is the one which ends it. glyph_text_box() asks gd
+	for the others.
+   -------------------------------------------------------------------- */
+static void glyph_measure_right(glyph_cache_t *gc, char *font, int fsz)
+{
+	char text[GLYPH_PENS][GLYPH_PENS + 1];
+	int pen[GLYPH_PENS], right[GLYPH_PENS], n = 1;
+	int brect[8];
+
+	text[0][0] = '\0';
+	pen[0] = right[0] = 0;
+	for (int i = 0; i < n; ++i) {
+		size_t len = strlen(text[i]);
+		uint8_t last = len ? (uint8_t)text[i][len-1] : 0;
+		for (int b = ' '; b < GLYPH_CHARS; ++b) {
+			glyph_t *g = &gc->glyph[b];
+			if (!g->bm || (len >= GLYPH_PENS)) {
+				continue;
+			}
+			int p = pen[i] + (len ? gc->kern[last][b] : 0);
+			text[i][len] = (char)b;
+			text[i][len+1] = '\0';
+			if (text_bbox(font, fsz, text[i], brect) != NULL) {
+				text[i][len] = '\0';
+				continue;
+			}
+			text[i][len] = '\0';
+			int r;
+			if (((len == 0) || (brect[2] > right[i])) &&
+			    (glyph_right(g, p, &r) != 0) && (g->pens < GLYPH_PENS)) {
+				g->pen[g->pens] = glyph_frac(p);
+				g->right[g->pens++] = brect[2] - glyph_x(p);
+			}
+			/* a new fraction to try the characters with */
+			int q = p + g->advance, k;
+			for (k = 0; (k < n) && ((pen[k] - q) % GLYPH_UNIT != 0); ++k) {
+			}
+			if ((k == n) && (n < GLYPH_PENS)) {
+				memcpy(text[n], text[i], len);
+				text[n][len] = (char)b;
+				text[n][len+1] = '\0';
+				pen[n] = q;
+				right[n++] = brect[2];
+			}
+		}
+	}
+}
+
+/* --------------------------------------------------------------------
+	Pre-render the characters in chars (only ASCII ones) at font size
+	fsz, for text which is printed many times with different numbers
+	in it. render_glyphs() then draws such text from the cached
+	bitmaps instead of having FreeType lay it out again for every
+	label. Returns NULL on error.
+   -------------------------------------------------------------------- */
+glyph_cache_t *glyph_cache_new(char *font, int fsz, const char *chars)
+{
+	glyph_cache_t *gc = calloc(1, sizeof(glyph_cache_t));
+	double t0 = phase_clock();
+	int brect[8];
+
+	if (!gc) {
+		return NULL;
+	}
+	pthread_once(&font_setup_once, font_setup);
+	gc->font = font;
+	gc->fsz = fsz;
+	if (text_bbox(font, fsz, "o", brect) != NULL) {
+		free(gc);
+		return NULL;
+	}
+	gc->o_bottom = brect[1];
+	for (const char *p = chars; *p; ++p) {
+		uint8_t c = (uint8_t)*p;
+		if ((c < ' ') || (c >= GLYPH_CHARS) || gc->glyph[c].bm) {
+			continue;
+		}
+		if (glyph_render(&gc->glyph[c], font, fsz, (char)c) != 0) {
+			glyph_cache_free(gc);
+			return NULL;
+		}
+	}
+	/* the kerning of every pair of cached characters */
+	for (int a = ' '; a < GLYPH_CHARS; ++a) {
+		for (int b = ' '; gc->glyph[a].bm && (b < GLYPH_CHARS); ++b) {
+			char s[3] = { (char)a, (char)b, '\0' };
+			gdFTStringExtra ex = { .flags = gdFTEX_XSHOW };
+			if (!gc->glyph[b].bm ||
+			    (gdImageStringFTEx(NULL, &brect[0], -1, font, fsz, 0.0, 0, 0, s, &ex) != NULL)) {
+				continue;
+			}
+			if (ex.xshow) {
+				gc->kern[a][b] = (int)(strtod(ex.xshow, NULL) * GLYPH_UNIT + 0.5) - gc->glyph[a].advance;
+			}
+			gdFree(ex.xshow);
+		}
+	}
+	glyph_measure_right(gc, font, fsz);
+	phase_add(&phase_times.render, phase_clock() - t0);
+	return gc;
+}
+
+void glyph_cache_free(glyph_cache_t *gc)
+{
+	if (!gc) {
+		return;
+	}
+	for (int i = 0; i < GLYPH_CHARS; ++i) {
+		ptouch_bitmap_free(gc->glyph[i].bm);
+	}
+	free(gc);
+}
+
+/* bounding box of text drawn from the cache, the same as the one gd
+   reports: all character boxes put together. Where a character ends
+   it at a pen fraction glyph_measure_right() has no answer for (or may
+   start it, it is only measured at pen 0), the box of the text up to
+   there comes from gd. Returns -1 if a character of the text is not
+   cached. */
+static int glyph_text_box(glyph_cache_t *gc, char *text, int box[4])
+{
+	size_t len = strlen(text);
+	char part[len + 1];
+	int pen = 0, brect[8], r;
+
+	memset(box, 0, 4*sizeof(int));
+	for (char *p = text; *p; ++p) {
+		uint8_t c = (uint8_t)*p;
+		if ((c >= GLYPH_CHARS) || !gc->glyph[c].bm) {
+			return -1;
+		}
+		glyph_t *g = &gc->glyph[c];
+		int x = glyph_x(pen);
+		if (p == text) {
+			box[0] = g->box[0];
+			box[2] = g->box[2];
+		} else if ((x + g->box[0] > box[0] + 1) && (glyph_right(g, pen, &r) == 0)) {
+			if (x + r > box[2]) {
+				box[2] = x + r;
+			}
+		} else {
+			size_t n = (size_t)(p - text) + 1;
+			memcpy(part, text, n);
+			part[n] = '\0';
+			if (text_bbox(gc->font, gc->fsz, part, brect) != NULL) {
+				return -1;
+			}
+			box[0] = brect[0];
+			box[2] = brect[2];
+		}
+		if ((p == text) || (g->box[1] < box[1])) {
+			box[1] = g->box[1];
+		}
+		if ((p == text) || (g->box[3] > box[3])) {
+			box[3] = g->box[3];
+		}
+		pen += g->advance + gc->kern[c][(uint8_t)p[1]];
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Render lines of text from the glyphs in gc, laid out like
+	render_text() does at the font size of the cache, but without going
+	through FreeType, with the same pixels. ptouch-bench -s checks that
+	for a range of numbers.
+	Returns 0 on success, 1 if the text has characters which are not
+	in the cache (render it with render_text() then) or -1 on error.
+   -------------------------------------------------------------------- */
+int render_glyphs(glyph_cache_t *gc, char *line[], int lines, int print_width, ptouch_bitmap *out)
+{
+	double t0 = phase_clock();
+	int box[MAX_LINES][4];
+	int x = 0, max_height = 0;
+
+	*out = NULL;
+	if ((lines < 1) || (lines > MAX_LINES)) {
+		return -1;
+	}
+	for (int i = 0; i < lines; ++i) {
+		if (glyph_text_box(gc, line[i], box[i]) != 0) {
+			return 1;
+		}
+		if (box[i][2] - box[i][0] > x) {
+			x = box[i][2] - box[i][0];
+		}
+		if (box[i][3] - box[i][1] > max_height) {
+			max_height = box[i][3] - box[i][1];
+		}
+	}
+	if ((max_height * lines) > print_width) {
+		printf("Font size %d too large for %d lines\n", gc->fsz, lines);
+		return -1;
+	}
+	if ((*out = ptouch_bitmap_new(x, print_width)) == NULL) {
+		return -1;
+	}
+	int unused_px = print_width - (max_height * lines);
+	for (int i = 0; i < lines; ++i) {
+		int ofs = box[i][3] - gc->o_bottom;
+		int pos = (i*(print_width/lines)) + max_height - ofs + (unused_px/lines) / 2;
+		int off_x = -box[i][0], pen = 0;
+		if (arguments.align == ALIGN_CENTER) {
+			off_x += (x - (box[i][2] - box[i][0])) / 2;
+		} else if (arguments.align == ALIGN_RIGHT) {
+			off_x += x - (box[i][2] - box[i][0]);
+		}
+		for (char *p = line[i]; *p; ++p) {
+			glyph_t *g = &gc->glyph[(uint8_t)*p];
+			ptouch_bitmap_draw(*out, off_x + glyph_x(pen) + g->left, pos + g->top, g->bm);
+			pen += g->advance + gc->kern[(uint8_t)p[0]][(uint8_t)p[1]];
+		}
+	}
+	t0 = phase_clock() - t0;
+	thread_render += t0;
+	phase_add(&phase_times.render, t0);
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Build the label from all jobs in two passes: first render or
+	measure every segment to find the total length, then allocate the
+	output bitmap once and copy each segment to its final position.
+	Padding and cut marks are drawn directly into the output.
+	Returns -1 on error, *out is NULL if there is nothing to print.
+   -------------------------------------------------------------------- */
+int compose_label(job_t *job_list, int print_width, ptouch_bitmap *out)
+{
+	int n = 0, length = 0, width = 0, rc = 0;
+	double t0 = phase_clock(), render0 = thread_render;
+
+	*out = NULL;
+	for (job_t *job = job_list; job != NULL; job = job->next) {
+		++n;
+	}
+	ptouch_bitmap *seg = calloc(n ? n : 1, sizeof(ptouch_bitmap));
+	int *seg_len = calloc(n ? n : 1, sizeof(int));
+	if (!seg || !seg_len) {
+		fprintf(stderr, "Memory allocation failed\n");
+		free(seg);
+		free(seg_len);
+		return -1;
+	}
+	/* pass 1: render text and images, measure everything */
+	int i = 0;
+	for (job_t *job = job_list; job != NULL; job = job->next, ++i) {
+		gdImage *im = NULL;
+		if (arguments.debug) {
+			printf("job %p: type=%d | n=%d", job, job->type, job->n);
+			for (int k=0; k<MAX_LINES; ++k) {
+				printf(" | %s", job->lines[k]);
+			}
+			printf(" | next=%p\n", job->next);
+		}
+		switch (job->type) {
+			case JOB_IMAGE:
+				if ((seg[i] = image_load(job->lines[0])) == NULL) {
+					printf(_("failed to load image file\n"));
+					rc = -1;
+				}
+				break;
+			case JOB_TEXT:
+				if ((im = render_text(arguments.font_file, job->lines, job->n, print_width)) == NULL) {
+					printf(_("could not render text\n"));
+					rc = -1;
+				}
+				break;
+			case JOB_CUTMARK:
+				seg_len[i] = 9;
+				break;
+			case JOB_PAD:
+				seg_len[i] = job->n;
+				if ((seg_len[i] < 1) || (seg_len[i] > 256)) {
+					seg_len[i] = 1;
+				}
+				break;
+			default:
+				break;
+		}
+		if (im != NULL) {
+			/* only the bitmap of rendered text is kept */
+			if ((seg[i] = image_to_bitmap(im)) == NULL) {
+				rc = -1;
+			}
+			gdImageDestroy(im);
+		}
+		if (rc != 0) {
+			break;
+		}
+		if (seg[i] != NULL) {
+			seg_len[i] = seg[i]->length;
+			if (seg[i]->width > width) {
+				width = seg[i]->width;
+			}
+		} else if (seg_len[i] > 0) {
+			if (print_width > width) {
+				width = print_width;
+			}
+		}
+		length += seg_len[i];
+	}
+	/* pass 2: allocate the output once and place every segment */
+	if ((rc == 0) && (width > 0) && (length > 0)) {
+		if ((*out = ptouch_bitmap_new(length, width)) == NULL) {
+			rc = -1;
+		} else {
+			if (arguments.debug) {
+				printf("debug: created new img with size %d * %d\n", length, width);
+			}
+		}
+	}
+	int x = 0;
+	i = 0;
+	for (job_t *job = job_list; (job != NULL) && (i < n); job = job->next, ++i) {
+		if (*out != NULL) {
+			if (seg[i] != NULL) {
+				ptouch_bitmap_blit(*out, x, seg[i]);
+			} else if (job->type == JOB_CUTMARK) {
+				ptouch_bitmap_cutmark(*out, x + 5, print_width);
+			}
+			x += seg_len[i];
+		}
+		ptouch_bitmap_free(seg[i]);
+	}
+	free(seg);
+	free(seg_len);
+	phase_add(&phase_times.compose, phase_clock() - t0 - (thread_render - render0));
+	return rc;
+}
@@ -0,0 +1,412 @@
+/*
+	ptouch-template - labels with a fixed layout and variable text fields
+
+	Copyright (C) 2015-2025 Dominic Radermacher <dominic@familie-radermacher.ch>
+
+	This program is free software; you can redistribute it and/or modify it
+	under the terms of the GNU General Public License version 3 as
+	published by the Free Software Foundation
+
+	This program is distributed in the hope that it will be useful, but
+	WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+	See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program; if not, write to the Free Software Foundation,
+	Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include <stdio.h>	/* printf() */
+#include <stdlib.h>	/* malloc() */
+#include <stdbool.h>
+#include <string.h>	/* memcpy() */
+#include <limits.h>	/* LONG_MAX */
+#include <libintl.h>
+
+#include "ptouch.h"
+#include "ptouch-render.h"
+
+#define _(s) gettext(s)
+
+/* A template is split into parts: runs of static jobs (images, text
+   without fields, padding and cut marks), which are composed once, and
+   single text jobs with fields, which are rendered for every label.
+   The labels made from a template have the same job list as the
+   template, with the fields filled in. */
+
+/* --------------------------------------------------------------------
+	If p starts with a field like {1}, return its number and set *end
+	to the closing brace. Fields are numbered from 1, anything else
+	in braces (like {0} or {x}) is text. Returns 0 if p is no field.
+   -------------------------------------------------------------------- */
+long template_field(const char *p, const char **end)
+{
+	const char *q = p + 1;
+	long k = 0;
+
+	if (*p != '{') {
+		return 0;
+	}
+	while ((*q >= '0') && (*q <= '9')) {
+		if (k <= (LONG_MAX - 9) / 10) {
+			k = k * 10 + (*q - '0');
+		}
+		++q;
+	}
+	if ((q == p + 1) || (*q != '}') || (k < 1)) {
+		return 0;
+	}
+	if (end) {
+		*end = q;
+	}
+	return k;
+}
+
+/* does s contain a field like {1} ? */
+static bool has_field(const char *s)
+{
+	for (const char *p = strchr(s, '{'); p != NULL; p = strchr(p + 1, '{')) {
+		if (template_field(p, NULL) > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* is job a text job with fields ? */
+bool template_job_is_variable(job_t *job)
+{
+	if (job->type != JOB_TEXT) {
+		return false;
+	}
+	for (int i = 0; (i < job->n) && (i < MAX_LINES); ++i) {
+		if (job->lines[i] && has_field(job->lines[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* compose n jobs starting at job as a label of their own */
+static int compose_jobs(job_t *job, int n, int print_width, ptouch_bitmap *out)
+{
+	job_t *copy = calloc(n ? n : 1, sizeof(job_t));
+	int rc;
+
+	if (!copy) {
+		return -1;
+	}
+	for (int i = 0; i < n; ++i, job = job->next) {
+		copy[i] = *job;
+		copy[i].next = (i < n - 1) ? &copy[i + 1] : NULL;
+	}
+	rc = compose_label(n ? copy : NULL, print_width, out);
+	free(copy);
+	return rc;
+}
+
+/* encode the static part p of t for ptdev. Its rasterlines are not
+   counted in the statistics of ptdev until they are sent. */
+static int template_encode(label_template_t *t, template_part_t *p, ptouch_dev ptdev)
+{
+	struct _ptouch_stats before = ptdev->stats;
+
+	if (ptouch_record_begin(ptdev) != 0) {
+		return -1;
+	}
+	int rc = print_columns(ptdev, p->bm, 0, p->bm->length, t->offset, t->invert);
+	p->stats.raster_lines = ptdev->stats.raster_lines - before.raster_lines;
+	p->stats.raster_raw = ptdev->stats.raster_raw - before.raster_raw;
+	p->stats.raster_encoded = ptdev->stats.raster_encoded - before.raster_encoded;
+	ptdev->stats = before;
+	if ((ptouch_record_end(ptdev, &p->raster, &p->raster_len) != 0) || (rc != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Split the job list into parts and compose the static ones. If
+	ptdev is not NULL, the static parts are also encoded into the
+	rasterlines for that printer, to be sent by print_template().
+	Returns NULL on error.
+   -------------------------------------------------------------------- */
+label_template_t *template_compile(job_t *job_list, int print_width, ptouch_dev ptdev)
+{
+	label_template_t *t = calloc(1, sizeof(label_template_t));
+	int n = 0;
+
+	if (!t) {
+		return NULL;
+	}
+	for (job_t *job = job_list; job != NULL; job = job->next) {
+		++n;
+	}
+	if ((t->parts = calloc(n ? n : 1, sizeof(template_part_t))) == NULL) {
+		free(t);
+		return NULL;
+	}
+	t->invert = arguments.invert;
+	for (job_t *job = job_list; job != NULL; ) {
+		template_part_t *p = &t->parts[t->nparts++];
+		job_t *first = job;
+		if (template_job_is_variable(job)) {
+			p->variable = true;
+			p->njobs = 1;
+			job = job->next;
+			/* text is as high as the tape */
+			if (print_width > t->width) {
+				t->width = print_width;
+			}
+			continue;
+		}
+		while ((job != NULL) && !template_job_is_variable(job)) {
+			++p->njobs;
+			job = job->next;
+		}
+		if (compose_jobs(first, p->njobs, print_width, &p->bm) != 0) {
+			template_free(t);
+			return NULL;
+		}
+		if (p->bm && (p->bm->width > t->width)) {
+			t->width = p->bm->width;
+		}
+	}
+	/* make all static parts as wide as the label, parts are top aligned */
+	for (int i = 0; i < t->nparts; ++i) {
+		template_part_t *p = &t->parts[i];
+		if (p->bm && (p->bm->width < t->width)) {
+			ptouch_bitmap wide = ptouch_bitmap_new(p->bm->length, t->width);
+			if (!wide) {
+				template_free(t);
+				return NULL;
+			}
+			ptouch_bitmap_blit(wide, 0, p->bm);
+			ptouch_bitmap_free(p->bm);
+			p->bm = wide;
+		}
+	}
+	if (ptdev) {
+		t->offset = ((int)ptouch_get_max_width(ptdev) / 2) - (t->width/2);
+		for (int i = 0; i < t->nparts; ++i) {
+			template_part_t *p = &t->parts[i];
+			if (p->bm && (template_encode(t, p, ptdev) != 0)) {
+				template_free(t);
+				return NULL;
+			}
+		}
+		t->encoded = true;
+	}
+	return t;
+}
+
+void template_free(label_template_t *t)
+{
+	if (!t) {
+		return;
+	}
+	for (int i = 0; i < t->nparts; ++i) {
+		ptouch_bitmap_free(t->parts[i].bm);
+		free(t->parts[i].raster);
+		glyph_cache_free(t->parts[i].glyphs);
+	}
+	free(t->parts);
+	free(t);
+}
+
+/* --------------------------------------------------------------------
+	Choose the font size of every text part of t once for all labels,
+	so that the text of each of the nsamples job lists fits (they are
+	filled from the template like the labels will be), and so does the
+	tallest of the characters, any label may have it. Then pre-render
+	the characters of the samples and those in chars, which are all
+	the characters the fields of the labels will have.
+	template_compose() draws the text from these glyphs.
+	Returns -1 on error.
+   -------------------------------------------------------------------- */
+int template_glyphs(label_template_t *t, job_t **samples, int nsamples, const char *chars, int print_width)
+{
+	job_t **job = calloc(nsamples ? nsamples : 1, sizeof(job_t *));
+	int rc = 0;
+
+	if (!job) {
+		return -1;
+	}
+	memcpy(job, samples, nsamples * sizeof(job_t *));
+	for (int i = 0; (rc == 0) && (i < t->nparts); ++i) {
+		template_part_t *p = &t->parts[i];
+		if (p->variable) {
+			bool used[GLYPH_CHARS] = { false };
+			char set[GLYPH_CHARS];
+			int fsz = arguments.font_size, n = 0, lines = 1;
+			for (const char *c = chars; *c; ++c) {
+				if ((uint8_t)*c < GLYPH_CHARS) {
+					used[(uint8_t)*c] = true;
+				}
+			}
+			for (int s = 0; (rc == 0) && (s < nsamples) && job[s]; ++s) {
+				int tmp = arguments.font_size;
+				if ((tmp <= 0) && ((tmp = fit_fontsize(arguments.font_file, job[s]->lines, job[s]->n, print_width)) < 0)) {
+					rc = -1;
+					break;
+				}
+				if ((fsz <= 0) || (tmp < fsz)) {
+					fsz = tmp;
+				}
+				if (job[s]->n > lines) {
+					lines = job[s]->n;
+				}
+				for (int k = 0; k < job[s]->n; ++k) {
+					for (const char *c = job[s]->lines[k]; *c; ++c) {
+						if ((uint8_t)*c < GLYPH_CHARS) {
+							used[(uint8_t)*c] = true;
+						}
+					}
+				}
+			}
+			for (int c = ' '; c < GLYPH_CHARS; ++c) {
+				if (used[c]) {
+					set[n++] = (char)c;
+				}
+			}
+			set[n] = '\0';
+			if ((rc == 0) && (fsz > 0) && (arguments.font_size <= 0) && (n > 0)) {
+				int tmp = find_fontsize(print_width / lines, 0, arguments.font_file, set);
+				if ((tmp > 0) && (tmp < fsz)) {
+					fsz = tmp;
+				}
+			}
+			if ((rc == 0) && (fsz > 0)) {
+				printf(_("choosing font size=%i\n"), fsz);
+				if ((p->glyphs = glyph_cache_new(arguments.font_file, fsz, set)) == NULL) {
+					rc = -1;
+				}
+			}
+		}
+		for (int s = 0; s < nsamples; ++s) {
+			for (int k = 0; (k < p->njobs) && job[s]; ++k) {
+				job[s] = job[s]->next;
+			}
+		}
+	}
+	free(job);
+	return rc;
+}
+
+/* --------------------------------------------------------------------
+	Compose a label from t and its job list, which must have the same
+	jobs as the one t was made from. Only the text jobs with fields are
+	rendered. The static parts are copied into the label only if
+	fill_static is set, print_template() sends them from t instead.
+	*part_len is set to a malloc()ed array with the length of every
+	part on this label.
+	Returns -1 on error.
+   -------------------------------------------------------------------- */
+int template_compose(label_template_t *t, job_t *job_list, int print_width, bool fill_static, ptouch_bitmap *out, int **part_len)
+{
+	ptouch_bitmap *seg = calloc(t->nparts ? t->nparts : 1, sizeof(ptouch_bitmap));
+	int *len = calloc(t->nparts ? t->nparts : 1, sizeof(int));
+	job_t *job = job_list;
+	int length = 0, rc = 0;
+
+	*out = NULL;
+	*part_len = NULL;
+	if (!seg || !len) {
+		free(seg);
+		free(len);
+		return -1;
+	}
+	for (int i = 0; (rc == 0) && (i < t->nparts); ++i) {
+		template_part_t *p = &t->parts[i];
+		if (p->variable) {
+			if (!job) {
+				rc = -1;
+				break;
+			}
+			if (job->n > 0) {
+				int r = p->glyphs ? render_glyphs(p->glyphs, job->lines, job->n, print_width, &seg[i]) : 1;
+				if (r == 1) {
+					r = compose_jobs(job, 1, print_width, &seg[i]);
+				}
+				if (r != 0) {
+					rc = -1;
+				}
+			}
+			len[i] = seg[i] ? seg[i]->length : 0;
+		} else {
+			len[i] = p->bm ? p->bm->length : 0;
+		}
+		for (int k = 0; (k < p->njobs) && job; ++k) {
+			job = job->next;
+		}
+		length += len[i];
+	}
+	if ((rc == 0) && (length > 0) && ((*out = ptouch_bitmap_new(length, t->width)) == NULL)) {
+		rc = -1;
+	}
+	for (int i = 0, x = 0; i < t->nparts; ++i) {
+		if (*out) {
+			if (seg[i]) {
+				ptouch_bitmap_blit(*out, x, seg[i]);
+			} else if (fill_static && t->parts[i].bm) {
+				ptouch_bitmap_blit(*out, x, t->parts[i].bm);
+			}
+			x += len[i];
+		}
+		ptouch_bitmap_free(seg[i]);
+	}
+	free(seg);
+	if ((rc != 0) || !*out) {
+		ptouch_bitmap_free(*out);
+		*out = NULL;
+		free(len);
+		return rc;
+	}
+	*part_len = len;
+	return 0;
+}
+
+/* --------------------------------------------------------------------
+	Print a label made by template_compose(): the static parts are sent
+	as they were encoded by template_compile(), only the columns of the
+	variable parts are rasterized and encoded.
+   -------------------------------------------------------------------- */
+int print_template(ptouch_dev ptdev, label_template_t *t, ptouch_bitmap bm, const int *part_len, int chain, int precut)
+{
+	double t0 = phase_clock(), usb0 = ptdev->stats.tx_seconds;
+	int offset, rc;
+
+	if (!bm || !t->encoded) {
+		printf(_("nothing to print\n"));
+		return -1;
+	}
+	if ((offset = print_begin(ptdev, bm->length, bm->width, chain, precut)) < 0) {
+		return -1;
+	}
+	if (offset != t->offset) {
+		printf(_("the template was made for another printer\n"));
+		ptouch_async_end(ptdev);
+		return -1;
+	}
+	for (int i = 0, x = 0; i < t->nparts; x += part_len[i], ++i) {
+		template_part_t *p = &t->parts[i];
+		if (p->variable) {
+			rc = print_columns(ptdev, bm, x, part_len[i], offset, t->invert);
+		} else if (p->raster) {
+			rc = ptouch_send(ptdev, p->raster, p->raster_len);
+			ptdev->stats.raster_lines += p->stats.raster_lines;
+			ptdev->stats.raster_raw += p->stats.raster_raw;
+			ptdev->stats.raster_encoded += p->stats.raster_encoded;
+		} else {
+			rc = 0;
+		}
+		if (rc != 0) {
+			ptouch_async_end(ptdev);
+			return -1;
+		}
+	}
+	rc = print_end(ptdev);
+	phase_add(&phase_times.raster, phase_clock() - t0 - (ptdev->stats.tx_seconds - usb0));
+	return rc;
+}